@@ -23,11 +23,24 @@ extern "C" {
 #endif
 
 void* kv_set_new(void);
+void* kv_set_new_arena(size_t size_hint); /* pairs bump-allocated; O(1) clear */
 void kv_set_free(void*);
 void kv_set_clear(void*);
 void kv_set_dump(void *set,FILE *out);
 void kv_add(void*set, const char *key, int klen, const char *val, int vlen);
-kv_t *kv_get(void*set, char *key);
+kv_t *kv_get(void*set, const char *key);
+kv_t *kv_getn(void*set, const char *key, int klen);
+/* prepared key: length and hash computed once, for repeated lookups */
+typedef struct { const char *key; int klen; unsigned hashv; } kv_key_t;
+void kv_key_init(kv_key_t *k, const char *key);
+kv_t *kv_getk(void*set, const kv_key_t *k);
+/* schema: known keys get a fixed slot in the sets bound to the schema */
+void *kv_schema_new(const char **keys, int n);
+int kv_schema_slot(void *schema, const char *key); /* -1 if not in schema */
+void kv_schema_free(void *schema); /* after the sets bound to it */
+void *kv_set_new_schema(void *schema); /* arena-backed */
+void *kv_set_schema(void *set);
+kv_t *kv_get_slot(void *set, int slot); /* NULL if unset */
 #define kv_adds(set, key, val) kv_add(set,key,strlen(key),val,strlen(val))
 int kv_len(void*set);
 kv_t *kv_next(void*set,kv_t *kv);
@@ -39,12 +52,54 @@ void *kv_spoolreader_new(const char *dir);
 void *kv_spoolreader_new_nb(const char *dir, int *fd);
 int kv_spool_read(void*sp, void *set, int blocking);
 int kv_spool_readN(void*sp, void **set, int *nset);
+/* zero-copy variants: keys/vals point into the frame; valid til next read */
+int kv_spool_read_view(void*sp, void *set);
+int kv_spool_readN_view(void*sp, void **set, int *nset);
+/* raw frame image, not decoded; valid til next read */
+int kv_spool_read_raw(void*sp, char **img, size_t *len);
+void kv_spoolreader_maxframe(void*sp, size_t maxframe); /* default 10mb */
+void kv_spoolreader_batch(void*sp, size_t bytes, int hugepages); /* readN */
+int kv_spoolreader_threads(void*sp, int n); /* readN decode threads */
+int kv_spoolreader_project(void*sp, const char **keys, int n); /* 0: all */
+int kv_spoolreader_filter(void*sp, void *filter); /* reader frees filter */
 void kv_spoolreader_free(void*);
+/* multi-spool reader: one reader over n spools; *src tells which spool */
+void *kv_spoolreader_multi_new(const char **dirs, int n, int *fd); /* fd: nb */
+void kv_spoolreader_multi_weight(void*sp, int src, int weight);
+int kv_spool_multi_read(void*sp, void *set, int *src);
+int kv_spool_multi_read_view(void*sp, void *set, int *src);
+void kv_spoolreader_multi_free(void*);
 
 void *kv_spoolwriter_new(const char *dir);
 int kv_spool_write(void*sp, void *set);
 int kv_spool_writeN(void *sp, void **setv, int nset);
-void kv_spoolwriter_free(void*);
+int kv_spool_write_raw(void *sp, const char *img, size_t len);
+/* two-phase write: encode a frame into the reservation, then commit it */
+char *kv_spool_reserve(void *sp, size_t maxlen);
+int kv_spool_commit(void *sp, size_t used);
+void kv_spool_abort(void *sp);
+size_t kv_frame_len(void *set);
+size_t kv_frame_encode(void *set, char *buf, size_t len);
+void kv_spoolwriter_free(void*); /* an async writer drains first */
+/* async writer: sets are queued to a thread that writes them in batches */
+#define KV_ASYNC_BLOCK 0  /* a write on a full queue waits */
+#define KV_ASYNC_DROP  1  /* a write on a full queue drops the set */
+void *kv_spoolwriter_new_async(const char *dir, int depth, int policy);
+int kv_spool_flush(void *sp);
+size_t kv_spoolwriter_dropped(void *sp);
+
+/******************************************************************************
+ * frame filter API: predicates on the value of a key, combined by and/or
+ *****************************************************************************/
+void *kv_filter_eq(const char *key, const char *val);
+void *kv_filter_prefix(const char *key, const char *prefix);
+void *kv_filter_range(const char *key, double lo, double hi);
+void *kv_filter_regex(const char *key, const char *regex); /* POSIX ERE */
+void *kv_filter_fn(const char *key, int (*fn)(const char *val, int vlen,
+                   void *arg), void *arg);
+void *kv_filter_and(void *a, void *b);
+void *kv_filter_or(void *a, void *b);
+void kv_filter_free(void *filter);
 
 /******************************************************************************
  * special purpose API 
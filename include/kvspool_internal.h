@@ -1,10 +1,120 @@
 #ifndef _KVSPOOL_INTERNAL_H_
 #define _KVSPOOL_INTERNAL_H_
 
+#include <stdint.h>
+#include <sys/uio.h>
 #include "kvspool.h"
 
-typedef struct { 
-  kv_t *kvs; 
+/* arena block. an arena-backed set bump-allocates its pairs from a chain
+ * of these; clearing the set just rewinds to the first block */
+typedef struct kv_blk {
+  struct kv_blk *next;
+  size_t n;         /* capacity of d */
+  size_t u;         /* bytes of d in use */
+  char d[];         /* C99 flexible array member */
+} kv_blk_t;
+
+/* schema: keys that get a fixed slot in each set bound to the schema */
+typedef struct {
+  char *key;
+  int klen;
+  int slot;
+  UT_hash_handle hh;
+} kvslot_t;
+
+typedef struct {
+  kvslot_t *slot;   /* n slots, in schema order */
+  kvslot_t *index;  /* the slots hashed by key */
+  int n;
+} kvschema_t;
+
+typedef struct {
+  kv_t *kvs;
+  kv_blk_t *blks;   /* arena blocks; NULL unless arena-backed */
+  kv_blk_t *cur;    /* arena block currently being filled */
+  kvschema_t *schema; /* NULL unless bound to a schema */
+  kv_t *slots;      /* a pair per schema key, val NULL if unset; the
+                     * other keys go in kvs */
+  int nslots;       /* slots that are set */
 } kvset_t;
 
+/* add a pair whose key/val point into caller memory instead of copies.
+ * makes an empty set arena-backed. used for view reads */
+void kv_add_view(void *set, char *key, int klen, char *val, int vlen);
+
+/* spool reader handle */
+struct shr;
+typedef struct kvfilt kvfilt_t;
+typedef struct kvdp kvdp_t;
+typedef struct {
+  char *key;
+  int klen;
+} kvproj_t;
+typedef struct {
+  struct shr *shr;
+  char *buf;        /* receive buffer; holds the frame from kv_spool_read */
+  size_t bsz;       /* allocated size of buf */
+  size_t maxframe;  /* limit to which buf may grow */
+  char *bbuf;       /* batch buffer; holds the frames from kv_spool_readN */
+  size_t bbsz;      /* allocated size of bbuf */
+  size_t batch;     /* batch byte budget; bbuf is allocated to this size */
+  int hugepages;    /* bbuf is mmap'd, preferably from huge pages */
+  struct iovec *iov; /* frames of the last batch */
+  size_t iovn;      /* allocated length of iov */
+  kvproj_t *proj;   /* keys to keep when decoding; all if nproj is 0 */
+  int nproj;
+  kvfilt_t *filter; /* frames must pass this to be decoded, if set */
+  kvfilt_t **leaves; /* predicates of the filter */
+  int nleaves;
+  kvdp_t *dp;       /* batch decode thread pool, if any */
+} kvspr_t;
+
+int kv_filter_leaves(kvfilt_t *f, kvfilt_t **leaves);
+int kv_filter_match(kvspr_t *r, char *img, size_t sz);
+
+/* multi-spool reader handle */
+struct epoll_event;
+typedef struct {
+  kvspr_t **r;      /* one nonblocking reader per spool */
+  int *weight;      /* reads per turn, per spool */
+  int *ready;       /* spool may have data */
+  struct epoll_event *ev;
+  int n;            /* number of spools */
+  int cur;          /* spool whose turn it is */
+  int credit;       /* reads left in this turn */
+  int epfd;
+  int blocking;
+} kvspm_t;
+
+/* spool writer handle */
+typedef struct kvaq kvaq_t;
+typedef struct {
+  struct shr *shr;
+  char *buf;        /* encode buffer; frames are encoded back to back here */
+  size_t bsz;       /* allocated size of buf */
+  struct iovec *iov; /* frames of the batch being written */
+  size_t iovn;      /* allocated length of iov */
+  size_t rsv;       /* bytes of buf reserved by kv_spool_reserve, or 0 */
+  kvaq_t *aq;       /* queue to the writer thread, if async */
+} kvspw_t;
+
+size_t kv_spool_encode(kvspw_t *w, size_t off, kvset_t *set);
+int kv_async_write(kvspw_t *w, kvset_t *set);
+void kv_async_stop(kvspw_t *w);
+
+/* in-place walk over the key/value pairs of a frame image */
+typedef struct {
+  char *p;          /* next pair */
+  char *eof;        /* end of image */
+  uint32_t n;       /* pairs remaining */
+  uint32_t kl;      /* length of next key, read ahead */
+  int native;       /* native frame; otherwise a tpl image */
+  int swap;         /* image is of opposite endianness */
+  int oldstr;       /* image has pre-1.3 tpl string lengths */
+  int nul;          /* nul-terminate keys/vals in the image as we go */
+} kv_frame_t;
+
+int kv_frame_open(kv_frame_t *f, char *img, size_t sz, int nul);
+int kv_frame_next(kv_frame_t *f, char **key, int *klen, char **val, int *vlen);
+
 #endif
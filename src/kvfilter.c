@@ -0,0 +1,210 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <regex.h>
+#include "kvspool_internal.h"
+
+/*******************************************************************************
+ * frame filters
+ *
+ * a filter is a tree of AND/OR nodes over leaf predicates on the value of one
+ * key each. a reader with a filter tests each frame it reads against the
+ * frame image before decoding it: one walk over the pairs evaluates every
+ * leaf whose key appears, leaves whose key is absent are false, and then the
+ * tree is evaluated from the leaf results. frames that fail are skipped
+ * without building a set.
+ ******************************************************************************/
+#define KV_RANGE_NUMSZ 64 /* longest value tested as a number */
+
+enum { KVF_EQ, KVF_PREFIX, KVF_RANGE, KVF_REGEX, KVF_FN, KVF_AND, KVF_OR };
+
+struct kvfilt {
+  int op;
+  char *key;
+  int klen;
+  char *val;        /* eq, prefix */
+  int vlen;
+  double lo, hi;    /* range */
+  regex_t re;       /* regex */
+  int (*fn)(const char *val, int vlen, void *arg);
+  void *arg;
+  struct kvfilt *a, *b;
+  int hit;          /* leaf result for the frame being tested */
+};
+
+static kvfilt_t *leaf_new(int op, const char *key) {
+  kvfilt_t *f;
+  if ( (f = calloc(1, sizeof(*f))) == NULL) goto oom;
+  f->op = op;
+  if ( (f->key = strdup(key)) == NULL) goto oom;
+  f->klen = strlen(key);
+  return f;
+
+ oom:
+  fprintf(stderr, "out of memory\n");
+  if (f) free(f);
+  return NULL;
+}
+
+static kvfilt_t *leaf_val(int op, const char *key, const char *val) {
+  kvfilt_t *f;
+  if ( (f = leaf_new(op, key)) == NULL) return NULL;
+  if ( (f->val = strdup(val)) == NULL) {
+    fprintf(stderr, "out of memory\n");
+    kv_filter_free(f);
+    return NULL;
+  }
+  f->vlen = strlen(val);
+  return f;
+}
+
+void *kv_filter_eq(const char *key, const char *val) {
+  return leaf_val(KVF_EQ, key, val);
+}
+
+void *kv_filter_prefix(const char *key, const char *prefix) {
+  return leaf_val(KVF_PREFIX, key, prefix);
+}
+
+/* value parses as a number in [lo,hi] */
+void *kv_filter_range(const char *key, double lo, double hi) {
+  kvfilt_t *f;
+  if ( (f = leaf_new(KVF_RANGE, key)) == NULL) return NULL;
+  f->lo = lo;
+  f->hi = hi;
+  return f;
+}
+
+/* value matches the POSIX extended regex */
+void *kv_filter_regex(const char *key, const char *regex) {
+  char err[100];
+  kvfilt_t *f;
+  int rc;
+
+  if ( (f = leaf_new(KVF_REGEX, key)) == NULL) return NULL;
+  if ( (rc = regcomp(&f->re, regex, REG_EXTENDED|REG_NOSUB)) != 0) {
+    regerror(rc, &f->re, err, sizeof(err));
+    fprintf(stderr, "regex %s: %s\n", regex, err);
+    free(f->key);
+    free(f);
+    return NULL;
+  }
+  return f;
+}
+
+/* fn returns nonzero if the value passes. the value is not nul-terminated */
+void *kv_filter_fn(const char *key, int (*fn)(const char *val, int vlen,
+                   void *arg), void *arg) {
+  kvfilt_t *f;
+  if ( (f = leaf_new(KVF_FN, key)) == NULL) return NULL;
+  f->fn = fn;
+  f->arg = arg;
+  return f;
+}
+
+static kvfilt_t *node_new(int op, kvfilt_t *a, kvfilt_t *b) {
+  kvfilt_t *f;
+  if ((a == NULL) || (b == NULL)) goto fail;
+  if ( (f = calloc(1, sizeof(*f))) == NULL) {
+    fprintf(stderr, "out of memory\n");
+    goto fail;
+  }
+  f->op = op;
+  f->a = a;
+  f->b = b;
+  return f;
+
+ fail:
+  if (a) kv_filter_free(a);
+  if (b) kv_filter_free(b);
+  return NULL;
+}
+
+/* these take over a and b (freeing them on failure) */
+void *kv_filter_and(void *a, void *b) {
+  return node_new(KVF_AND, (kvfilt_t*)a, (kvfilt_t*)b);
+}
+
+void *kv_filter_or(void *a, void *b) {
+  return node_new(KVF_OR, (kvfilt_t*)a, (kvfilt_t*)b);
+}
+
+void kv_filter_free(void *_f) {
+  kvfilt_t *f = (kvfilt_t*)_f;
+  if (f == NULL) return;
+  kv_filter_free(f->a);
+  kv_filter_free(f->b);
+  if (f->op == KVF_REGEX) regfree(&f->re);
+  if (f->key) free(f->key);
+  if (f->val) free(f->val);
+  free(f);
+}
+
+/* list the leaves of f into leaves (if non-NULL); returns the count */
+int kv_filter_leaves(kvfilt_t *f, kvfilt_t **leaves) {
+  int n;
+  if ((f->op == KVF_AND) || (f->op == KVF_OR)) {
+    n = kv_filter_leaves(f->a, leaves);
+    return n + kv_filter_leaves(f->b, leaves ? leaves + n : NULL);
+  }
+  if (leaves) leaves[0] = f;
+  return 1;
+}
+
+static int leaf_test(kvfilt_t *f, char *val, int vlen) {
+  char num[KV_RANGE_NUMSZ], *end;
+  regmatch_t m;
+  double d;
+
+  switch(f->op) {
+    case KVF_EQ:
+      return (vlen == f->vlen) && !memcmp(val, f->val, vlen);
+    case KVF_PREFIX:
+      return (vlen >= f->vlen) && !memcmp(val, f->val, f->vlen);
+    case KVF_RANGE:
+      if ((vlen == 0) || (vlen >= sizeof(num))) return 0;
+      memcpy(num, val, vlen);
+      num[vlen] = '\0';
+      d = strtod(num, &end);
+      if (*end != '\0') return 0;
+      return (d >= f->lo) && (d <= f->hi);
+    case KVF_REGEX:
+      m.rm_so = 0;
+      m.rm_eo = vlen;
+      return regexec(&f->re, val, 1, &m, REG_STARTEND) == 0;
+    case KVF_FN:
+      return f->fn(val, vlen, f->arg) ? 1 : 0;
+  }
+  return 0;
+}
+
+static int eval(kvfilt_t *f) {
+  switch(f->op) {
+    case KVF_AND: return eval(f->a) && eval(f->b);
+    case KVF_OR:  return eval(f->a) || eval(f->b);
+  }
+  return f->hit;
+}
+
+/* does the frame image pass the reader's filter */
+int kv_filter_match(kvspr_t *r, char *img, size_t sz) {
+  char *key, *val;
+  int klen, vlen, i, sc, seen=0;
+  kv_frame_t f;
+
+  if (kv_frame_open(&f, img, sz, 0) < 0) return 0;
+  for(i=0; i < r->nleaves; i++) r->leaves[i]->hit = 0;
+
+  while ( (sc = kv_frame_next(&f, &key, &klen, &val, &vlen)) > 0) {
+    for(i=0; i < r->nleaves; i++) {
+      kvfilt_t *l = r->leaves[i];
+      if ((l->klen != klen) || memcmp(l->key, key, klen)) continue;
+      l->hit = leaf_test(l, val, vlen);
+      seen++;
+    }
+    if (seen >= r->nleaves) break; /* every leaf key found */
+  }
+  if (sc < 0) return 0;
+
+  return eval(r->filter);
+}
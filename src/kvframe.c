@@ -0,0 +1,164 @@
+#include <stdio.h>
+#include <string.h>
+#include "kvspool_internal.h"
+
+/*******************************************************************************
+ * frame images
+ *
+ * a frame is written in the native kv frame format:
+ *
+ *   "kv" version(1) flags(1) count(4) { klen(4) vlen(4) key \0 val \0 }...
+ *
+ * lengths are in the byte order given by the flags, and exclude the nul
+ * that follows each key and val. the encoded size of a set is therefore
+ * known up front, encoding is one pass into a flat buffer, and decoding
+ * can hand out pointers to the keys and vals as they lie in the image.
+ *
+ * frames written by earlier versions are tpl images of format A(ss):
+ *
+ *   "tpl" flags(1) len(4) "A(ss)\0" count(4) { klen(4) key vlen(4) val }...
+ *
+ * each string length is the string length plus one (0 for a NULL string),
+ * or the plain length in images from tpl versions prior to 1.3. 
+ *
+ * kv_frame_open and kv_frame_next walk the pairs of either kind of image
+ * where it lies. with nul set, each key and val of a tpl image is 
+ * nul-terminated in the image as it is returned, by overwriting the length
+ * prefix that follows it (which has already been read by then). terminating
+ * the last val writes one byte past the end of the image, so the caller 
+ * must have room for it there. native images are never written to.
+ ******************************************************************************/
+#define KVF_VERSION 1
+#define KVF_FL_BIGENDIAN (1 << 0)
+#define KVF_HDR_LEN 8    /* magic, version, flags, count */
+#define TPL_FL_BIGENDIAN   (1 << 0)
+#define TPL_FL_NULLSTRINGS (1 << 1)
+#define TPL_HDR_LEN 14   /* magic, flags, len, format string */
+
+static int cpu_bigendian(void) {
+  unsigned i = 1;
+  return (*(char*)&i == 1) ? 0 : 1;
+}
+
+static uint32_t frame_u32(kv_frame_t *f, char *p) {
+  uint32_t u;
+  memcpy(&u, p, sizeof(u));
+  if (f->swap) u = (u >> 24) | ((u >> 8) & 0xff00) |
+                   ((u << 8) & 0xff0000) | (u << 24);
+  return u;
+}
+
+static void frame_put32(char *p, uint32_t u) {
+  memcpy(p, &u, sizeof(u));
+}
+
+/* returns the exact length of the native frame image of set */
+size_t kv_frame_len(void *set) {
+  size_t len = KVF_HDR_LEN;
+  kv_t *kv = NULL;
+  while ( (kv = kv_next(set, kv))) len += 2*sizeof(uint32_t) + kv->klen+1 + kv->vlen+1;
+  return len;
+}
+
+/* encodes set as a native frame image into buf. returns the image length,
+ * or 0 if it does not fit in len bytes (kv_frame_len gives the size) */
+size_t kv_frame_encode(void *set, char *buf, size_t len) {
+  char *p = buf, *eob = buf + len;
+  kv_t *kv = NULL;
+
+  if (len < KVF_HDR_LEN) return 0;
+  p[0] = 'k'; p[1] = 'v';
+  p[2] = KVF_VERSION;
+  p[3] = cpu_bigendian() ? KVF_FL_BIGENDIAN : 0;
+  frame_put32(p + 4, kv_len(set));
+  p += KVF_HDR_LEN;
+
+  while ( (kv = kv_next(set, kv))) {
+    if (eob - p < 2*sizeof(uint32_t) + kv->klen+1 + kv->vlen+1) return 0;
+    frame_put32(p, kv->klen); p += sizeof(uint32_t);
+    frame_put32(p, kv->vlen); p += sizeof(uint32_t);
+    memcpy(p, kv->key, kv->klen); p += kv->klen; *p++ = '\0';
+    memcpy(p, kv->val, kv->vlen); p += kv->vlen; *p++ = '\0';
+  }
+  return p - buf;
+}
+
+/* read the length prefix of the string at p, checking it fits the image */
+static int frame_strlen(kv_frame_t *f, char *p, uint32_t *len) {
+  uint32_t l;
+  if (f->eof - p < sizeof(uint32_t)) return -1;
+  l = frame_u32(f, p);
+  if (!f->oldstr) l = l ? l-1 : 0; /* a NULL string reads as empty */
+  if (f->eof - (p + sizeof(uint32_t)) < l) return -1;
+  *len = l;
+  return 0;
+}
+
+/* returns 0 on success, -1 if img is not a frame image */
+int kv_frame_open(kv_frame_t *f, char *img, size_t sz, int nul) {
+  memset(f, 0, sizeof(*f));
+  f->eof = img + sz;
+  f->nul = nul;
+
+  if ((sz >= KVF_HDR_LEN) && (img[0] == 'k') && (img[1] == 'v')) {
+    if (img[2] != KVF_VERSION) {
+      fprintf(stderr, "unsupported frame version %d\n", (int)img[2]);
+      return -1;
+    }
+    f->native = 1;
+    f->swap = ((img[3] & KVF_FL_BIGENDIAN) ? 1 : 0) != cpu_bigendian();
+    f->n = frame_u32(f, img + 4);
+    f->p = img + KVF_HDR_LEN;
+    return 0;
+  }
+
+  if (sz < TPL_HDR_LEN + sizeof(uint32_t)) return -1;
+  if (memcmp(img, "tpl", 3)) return -1;
+  if (memcmp(img + 8, "A(ss)", 6)) return -1;
+  f->swap = ((img[3] & TPL_FL_BIGENDIAN) ? 1 : 0) != cpu_bigendian();
+  f->oldstr = (img[3] & TPL_FL_NULLSTRINGS) ? 0 : 1;
+
+  f->n = frame_u32(f, img + TPL_HDR_LEN);
+  f->p = img + TPL_HDR_LEN + sizeof(uint32_t);
+  if (f->n && (frame_strlen(f, f->p, &f->kl) < 0)) return -1;
+  return 0;
+}
+
+/* returns 1 with the next pair, 0 after the last pair, -1 if truncated */
+int kv_frame_next(kv_frame_t *f, char **key, int *klen, char **val, int *vlen) {
+  uint32_t kl, vl;
+  char *k, *v;
+
+  if (f->n == 0) return 0;
+
+  if (f->native) {
+    if (f->eof - f->p < 2*sizeof(uint32_t)) return -1;
+    kl = frame_u32(f, f->p);
+    vl = frame_u32(f, f->p + sizeof(uint32_t));
+    k = f->p + 2*sizeof(uint32_t);
+    if (f->eof - k < (size_t)kl + vl + 2) return -1;
+    v = k + kl + 1;
+    if ((k[kl] != '\0') || (v[vl] != '\0')) return -1;
+    f->p = v + vl + 1;
+    f->n--;
+    *key = k; *klen = kl;
+    *val = v; *vlen = vl;
+    return 1;
+  }
+
+  kl = f->kl;
+  k = f->p + sizeof(uint32_t);
+  if (frame_strlen(f, k + kl, &vl) < 0) return -1;
+  v = k + kl + sizeof(uint32_t);
+  f->p = v + vl;
+  if (--f->n && (frame_strlen(f, f->p, &f->kl) < 0)) return -1;
+
+  if (f->nul) {
+    k[kl] = '\0';
+    v[vl] = '\0';
+  }
+
+  *key = k; *klen = kl;
+  *val = v; *vlen = vl;
+  return 1;
+}
@@ -16,9 +16,66 @@ void* kv_set_new(void) {
   return set;
 }
 
+/*******************************************************************************
+ * arena-backed sets
+ *
+ * the kv_t's and their key/val bytes are bump-allocated from a chain of
+ * blocks owned by the set. nothing is freed per pair; clearing the set
+ * drops the hash table and rewinds the arena to its first block. blocks
+ * are kept, so a set that is refilled frame after frame stops allocating
+ * once its arena has grown to fit the largest frame.
+ ******************************************************************************/
+#define KV_ARENA_DEFAULT 4096
+#define KV_ALIGN(x) (((x) + sizeof(void*) - 1) & ~(sizeof(void*) - 1))
+
+static kv_blk_t *kv_blk_new(size_t sz) {
+  kv_blk_t *b;
+  if ( (b = malloc(sizeof(*b) + sz)) == NULL) sp_oom();
+  b->next = NULL;
+  b->n = sz;
+  b->u = 0;
+  return b;
+}
+
+static void *kv_arena_alloc(kvset_t *set, size_t len) {
+  kv_blk_t *b = set->cur;
+  void *p;
+
+  len = KV_ALIGN(len);
+  while (b->u + len > b->n) {
+    /* advance to the next block, appending one if needed. blocks 
+     * past cur are stale from an earlier fill so rewind them here */
+    if (b->next == NULL) b->next = kv_blk_new(len > b->n ? len : b->n);
+    b = b->next;
+    b->u = 0;
+  }
+  set->cur = b;
+  p = &b->d[b->u];
+  b->u += len;
+  return p;
+}
+
+void* kv_set_new_arena(size_t size_hint) {
+  kvset_t *set = kv_set_new();
+  set->blks = kv_blk_new(size_hint ? KV_ALIGN(size_hint) : KV_ARENA_DEFAULT);
+  set->cur = set->blks;
+  return set;
+}
+
 void kv_set_clear(void*_set) {
   kvset_t *set = (kvset_t*)_set;
   kv_t *kv, *tmp;
+  int i;
+  if (set->nslots) {
+    for(i=0; i < set->schema->n; i++) set->slots[i].val = NULL;
+    set->nslots = 0;
+  }
+  if (set->blks) { /* arena: O(1) reset, pairs are not individually freed */
+    HASH_CLEAR(hh, set->kvs);
+    set->cur = set->blks;
+    set->blks->u = 0;
+    return;
+  }
   HASH_ITER(hh, set->kvs, kv, tmp) {  
     HASH_DEL(set->kvs, kv);
     free(kv->key); free(kv->val); free(kv);
@@ -40,7 +97,15 @@ void kv_set_dump(void*_set,FILE *out) {
 
 void kv_set_free(void*_set) {
   kvset_t *set = (kvset_t*)_set;
+  kv_blk_t *b, *bn;
   kv_t *kv, *tmp;
+  if (set->blks) {
+    HASH_CLEAR(hh, set->kvs);
+    for(b = set->blks; b; b = bn) { bn = b->next; free(b); }
+    if (set->slots) free(set->slots);
+    free(set);
+    return;
+  }
   HASH_ITER(hh, set->kvs, kv, tmp) {
     HASH_DEL(set->kvs, kv);
     free(kv->key); free(kv->val);
@@ -50,20 +115,161 @@ void kv_set_free(void*_set) {
   free(set);
 }
 
-kv_t *kv_get(void*_set, char *key) {
+/* the slot pair for key, if the set has a schema that has key */
+static kv_t *schema_pair(kvset_t *set, const char *key, int klen) {
+  kvslot_t *s;
+  if (set->schema == NULL) return NULL;
+  HASH_FIND(hh, set->schema->index, key, klen, s);
+  return s ? &set->slots[s->slot] : NULL;
+}
+
+kv_t *kv_getn(void*_set, const char *key, int klen) {
   kv_t *kv;
   kvset_t *set = (kvset_t*)_set;
-  HASH_FIND(hh, set->kvs, key, strlen(key), kv);
+  if ( (kv = schema_pair(set, key, klen))) return kv->val ? kv : NULL;
+  HASH_FIND(hh, set->kvs, key, klen, kv);
+  return kv;
+}
+
+kv_t *kv_get(void*_set, const char *key) {
+  return kv_getn(_set, key, strlen(key));
+}
+
+/*******************************************************************************
+ * prepared keys
+ *
+ * a kv_key_t carries its length and its hash value, computed once by
+ * kv_key_init with the same hash function the sets use. kv_getk goes
+ * straight to the bucket. this uthash predates HASH_FIND_BYHASHVALUE,
+ * so the equivalent is spelled out here
+ ******************************************************************************/
+#define KV_FIND_BYHASHVALUE(hh,head,keyptr,keylen,hashval,out)                 \
+do {                                                                           \
+  unsigned _hf_bkt;                                                            \
+  out=NULL;                                                                    \
+  if (head) {                                                                  \
+    HASH_TO_BKT(hashval, (head)->hh.tbl->num_buckets, _hf_bkt);                \
+    if (HASH_BLOOM_TEST((head)->hh.tbl, hashval)) {                            \
+      HASH_FIND_IN_BKT((head)->hh.tbl, hh, (head)->hh.tbl->buckets[ _hf_bkt ], \
+                       keyptr,keylen,out);                                     \
+    }                                                                          \
+  }                                                                            \
+} while (0)
+
+/* the key string is not copied; it must outlive the prepared key */
+void kv_key_init(kv_key_t *k, const char *key) {
+  unsigned bkt;
+  k->key = key;
+  k->klen = strlen(key);
+  HASH_FCN(key, k->klen, 1, k->hashv, bkt);
+  (void)bkt; /* only the hash value is kept */
+}
+
+kv_t *kv_getk(void*_set, const kv_key_t *k) {
+  kv_t *kv;
+  kvslot_t *s;
+  kvset_t *set = (kvset_t*)_set;
+  if (set->schema) { /* the schema index hashes keys the same way */
+    KV_FIND_BYHASHVALUE(hh, set->schema->index, k->key, k->klen, k->hashv, s);
+    if (s) return set->slots[s->slot].val ? &set->slots[s->slot] : NULL;
+  }
+  KV_FIND_BYHASHVALUE(hh, set->kvs, k->key, k->klen, k->hashv, kv);
   return kv;
 }
 
+/*******************************************************************************
+ * schemas
+ *
+ * a set bound to a schema keeps the pairs of the schema keys in an array of
+ * slots, one per key, in schema order. setting one stores the val in the
+ * slot (its key is the schema's copy); no hash table is involved. keys not
+ * in the schema go in the set's hash table as usual. iteration visits the
+ * set slots in order and then the hashed pairs; clearing just unsets the
+ * slots. schema sets are arena-backed.
+ ******************************************************************************/
+void *kv_schema_new(const char **keys, int n) {
+  kvschema_t *sc;
+  kvslot_t *s;
+  int i;
+
+  if ( (sc = calloc(1, sizeof(*sc))) == NULL) sp_oom();
+  if ( (sc->slot = calloc(n ? n : 1, sizeof(kvslot_t))) == NULL) sp_oom();
+  for(i=0; i < n; i++) {
+    HASH_FIND(hh, sc->index, keys[i], strlen(keys[i]), s);
+    if (s) {
+      fprintf(stderr, "duplicate schema key %s\n", keys[i]);
+      kv_schema_free(sc);
+      return NULL;
+    }
+    s = &sc->slot[i];
+    if ( (s->key = strdup(keys[i])) == NULL) sp_oom();
+    s->klen = strlen(keys[i]);
+    s->slot = i;
+    HASH_ADD_KEYPTR(hh, sc->index, s->key, s->klen, s);
+    sc->n++;
+  }
+  return sc;
+}
+
+int kv_schema_slot(void *_sc, const char *key) {
+  kvschema_t *sc = (kvschema_t*)_sc;
+  kvslot_t *s;
+  HASH_FIND(hh, sc->index, key, strlen(key), s);
+  return s ? s->slot : -1;
+}
+
+void kv_schema_free(void *_sc) {
+  kvschema_t *sc = (kvschema_t*)_sc;
+  int i;
+  HASH_CLEAR(hh, sc->index);
+  for(i=0; i < sc->n; i++) free(sc->slot[i].key);
+  free(sc->slot);
+  free(sc);
+}
+
+void *kv_set_new_schema(void *_sc) {
+  kvschema_t *sc = (kvschema_t*)_sc;
+  kvset_t *set = kv_set_new_arena(0);
+  int i;
+  set->schema = sc;
+  if ( (set->slots = calloc(sc->n ? sc->n : 1, sizeof(kv_t))) == NULL) sp_oom();
+  for(i=0; i < sc->n; i++) {
+    set->slots[i].key = sc->slot[i].key;
+    set->slots[i].klen = sc->slot[i].klen;
+  }
+  return set;
+}
+
+void *kv_set_schema(void *_set) {
+  kvset_t *set = (kvset_t*)_set;
+  return set->schema;
+}
+
+kv_t *kv_get_slot(void *_set, int slot) {
+  kvset_t *set = (kvset_t*)_set;
+  if ((set->schema == NULL) || (slot < 0) || (slot >= set->schema->n)) return NULL;
+  return set->slots[slot].val ? &set->slots[slot] : NULL;
+}
+
 void kv_add(void*_set, const char *key, int klen, const char *val, int vlen) {
   kvset_t *set = (kvset_t*)_set;
   assert(klen); //assert(vlen);
   kv_t *kv;
+
+  if ( (kv = schema_pair(set, key, klen))) { /* slot; val from the arena */
+    if (kv->val == NULL) set->nslots++;
+    kv->val = kv_arena_alloc(set, vlen+1); kv->vlen = vlen;
+    memcpy(kv->val, val, vlen); kv->val[vlen]='\0';
+    return;
+  }
  
   /* check if we're replacing an existing key */
   HASH_FIND(hh, set->kvs, key, klen, kv);
+  if (kv && set->blks) { /* arena: old value stays in arena til clear */
+    kv->val = kv_arena_alloc(set, vlen+1); kv->vlen = vlen;
+    memcpy(kv->val, val, vlen); kv->val[vlen]='\0';
+    return;
+  }
   if (kv) { /* yes, free the old value and replace it */
     free(kv->val);
     if ( (kv->val = malloc(vlen+1)) == NULL) sp_oom(); kv->vlen = vlen;
@@ -71,6 +277,15 @@ void kv_add(void*_set, const char *key, int klen, const char *val, int vlen) {
     return;
   }
   /* new key. deep copy the key/val and add it, null term for convenience */
+  if (set->blks) { /* arena: pair and its bytes in one bump allocation */
+    kv = kv_arena_alloc(set, sizeof(*kv) + klen+1 + vlen+1);
+    kv->key = (char*)(kv+1);            kv->klen = klen;
+    kv->val = kv->key + klen+1;         kv->vlen = vlen;
+    memcpy(kv->key, key, klen); kv->key[klen]='\0';
+    memcpy(kv->val, val, vlen); kv->val[vlen]='\0';
+    HASH_ADD_KEYPTR(hh,set->kvs,kv->key,kv->klen,kv);
+    return;
+  }
   if ( (kv = malloc(sizeof(*kv))) == NULL) sp_oom();
   if ( (kv->key = malloc(klen+1)) == NULL) sp_oom(); kv->klen = klen;
   if ( (kv->val = malloc(vlen+1)) == NULL) sp_oom(); kv->vlen = vlen;
@@ -79,13 +294,46 @@ void kv_add(void*_set, const char *key, int klen, const char *val, int vlen) {
   HASH_ADD_KEYPTR(hh,set->kvs,kv->key,kv->klen,kv);
 }
 
+void kv_add_view(void*_set, char *key, int klen, char *val, int vlen) {
+  kvset_t *set = (kvset_t*)_set;
+  assert(klen);
+  kv_t *kv;
+
+  if (set->blks == NULL) { /* only the kv_t's come from the arena */
+    assert(set->kvs == NULL);
+    set->blks = kv_blk_new(KV_ARENA_DEFAULT);
+    set->cur = set->blks;
+  }
+  if ( (kv = schema_pair(set, key, klen))) {
+    if (kv->val == NULL) set->nslots++;
+    kv->val = val; kv->vlen = vlen;
+    return;
+  }
+  HASH_FIND(hh, set->kvs, key, klen, kv);
+  if (kv) { kv->val = val; kv->vlen = vlen; return; }
+  kv = kv_arena_alloc(set, sizeof(*kv));
+  kv->key = key; kv->klen = klen;
+  kv->val = val; kv->vlen = vlen;
+  HASH_ADD_KEYPTR(hh,set->kvs,kv->key,kv->klen,kv);
+}
+
 int kv_len(void*_set) {
   kvset_t *set = (kvset_t*)_set;
-  return set->kvs ? (HASH_COUNT(set->kvs)) : 0;
+  return set->nslots + (set->kvs ? (HASH_COUNT(set->kvs)) : 0);
 }
 
 kv_t *kv_next(void*_set,kv_t *kv) {
   kvset_t *set = (kvset_t*)_set;
+  int i = 0;
+  if (set->schema) { /* set slots first, then the hashed pairs */
+    if (kv && ((kv < set->slots) || (kv >= set->slots + set->schema->n))) 
+      return kv->hh.next;
+    if (kv) i = (kv - set->slots) + 1;
+    if (set->nslots) {
+      for(; i < set->schema->n; i++) if (set->slots[i].val) return &set->slots[i];
+    }
+    return set->kvs;
+  }
   if (!kv) return set->kvs; /* get first element */
   return kv->hh.next;
 }
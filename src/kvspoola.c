@@ -0,0 +1,279 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "shr.h"
+
+#include "kvspool.h"
+#include "kvspool_internal.h"
+
+/*******************************************************************************
+ * Asynchronous spool writer
+ *
+ * kv_spool_write on an async writer copies the set into a slot of a bounded
+ * lock-free queue (Vyukov's bounded MPMC array queue) and returns. a writer
+ * thread takes every ready slot in order, encodes them back to back and
+ * writes them to the spool with one shr_writev.
+ *
+ * each slot has a sequence number. a slot at position pos is free for a
+ * producer when its seq is pos, ready for the writer thread when it is pos+1,
+ * and free again for position pos+depth once the thread is done with it.
+ *
+ * the queue itself takes no locks. the mutex and condition variables are
+ * only used to sleep: the writer thread when the queue is empty, callers when
+ * it is full (under KV_ASYNC_BLOCK) or when flushing. the sleeping and
+ * waiters flags are checked after each publish/release so nobody signals
+ * unless someone sleeps. the flag and seq accesses on both sides of that
+ * handshake are sequentially consistent, so a wakeup can't be missed.
+ ******************************************************************************/
+#define KV_ASYNC_SETSZ 1024  /* initial arena size of each slot set */
+
+typedef struct {
+  atomic_size_t seq;
+  void *set;              /* arena set holding the copied pairs */
+} kvaq_slot_t;
+
+struct kvaq {
+  kvaq_slot_t *slots;
+  size_t depth;           /* power of two */
+  size_t mask;
+  int policy;             /* KV_ASYNC_BLOCK or KV_ASYNC_DROP */
+  atomic_size_t head;     /* next position to enqueue */
+  size_t tail;            /* next position to dequeue; writer thread only */
+  atomic_size_t done;     /* positions written to the spool */
+  atomic_size_t dropped;  /* sets dropped on a full queue */
+  atomic_int err;         /* writer thread hit a write error */
+  atomic_int sleeping;    /* writer thread is waiting for sets */
+  atomic_int waiters;     /* callers waiting for space or a flush */
+  int stop;
+  pthread_mutex_t mutex;
+  pthread_cond_t wake;    /* wakes the writer thread */
+  pthread_cond_t idle;    /* wakes waiting callers */
+  pthread_t thread;
+};
+
+/* is the slot at position pos ready to be dequeued */
+static int slot_ready(kvaq_t *q, size_t pos) {
+  kvaq_slot_t *s = &q->slots[pos & q->mask];
+  return atomic_load(&s->seq) == pos + 1;
+}
+
+/* is the slot at the head free for a producer */
+static int slot_free(kvaq_t *q) {
+  size_t pos = atomic_load(&q->head);
+  kvaq_slot_t *s = &q->slots[pos & q->mask];
+  return atomic_load(&s->seq) == pos;
+}
+
+static void wake_callers(kvaq_t *q) {
+  if (atomic_load(&q->waiters) == 0) return;
+  pthread_mutex_lock(&q->mutex);
+  pthread_cond_broadcast(&q->idle);
+  pthread_mutex_unlock(&q->mutex);
+}
+
+static void *writer_thread(void *_w) {
+  kvspw_t *w = (kvspw_t*)_w;
+  kvaq_t *q = w->aq;
+  size_t n, i, off;
+
+  for(;;) {
+
+    for(n=0; (n < q->depth) && slot_ready(q, q->tail + n); n++) ;
+
+    if (n == 0) {
+      pthread_mutex_lock(&q->mutex);
+      atomic_store(&q->sleeping, 1);
+      while (!slot_ready(q, q->tail) && !q->stop)
+        pthread_cond_wait(&q->wake, &q->mutex);
+      atomic_store(&q->sleeping, 0);
+      if (q->stop && !slot_ready(q, q->tail)) {
+        pthread_mutex_unlock(&q->mutex);
+        break;
+      }
+      pthread_mutex_unlock(&q->mutex);
+      continue;
+    }
+
+    /* group commit; the buffer may move as it grows, as in writeN */
+    for(off=0, i=0; i < n; i++) {
+      kvaq_slot_t *s = &q->slots[(q->tail + i) & q->mask];
+      w->iov[i].iov_len = kv_spool_encode(w, off, s->set);
+      if (w->iov[i].iov_len == 0) break;
+      off += w->iov[i].iov_len;
+    }
+    if (i < n) atomic_store(&q->err, 1);
+    else {
+      for(off=0, i=0; i < n; i++) {
+        w->iov[i].iov_base = w->buf + off;
+        off += w->iov[i].iov_len;
+      }
+      if (shr_writev(w->shr, w->iov, n) <= 0) {
+        fprintf(stderr, "shr_writev: error\n");
+        atomic_store(&q->err, 1);
+      }
+    }
+
+    /* release the slots for position + depth */
+    for(i=0; i < n; i++) {
+      kvaq_slot_t *s = &q->slots[(q->tail + i) & q->mask];
+      atomic_store(&s->seq, q->tail + i + q->depth);
+    }
+    q->tail += n;
+    atomic_store(&q->done, q->tail);
+    wake_callers(q);
+  }
+
+  return NULL;
+}
+
+/* returns 0 if the set was queued, 1 if the queue is full */
+static int aq_push(kvaq_t *q, kvset_t *set) {
+  kvaq_slot_t *s;
+  size_t pos, seq;
+  intptr_t diff;
+  kv_t *kv = NULL;
+
+  pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+  for(;;) {
+    s = &q->slots[pos & q->mask];
+    seq = atomic_load_explicit(&s->seq, memory_order_acquire);
+    diff = (intptr_t)seq - (intptr_t)pos;
+    if (diff == 0) {
+      if (atomic_compare_exchange_weak_explicit(&q->head, &pos, pos + 1,
+          memory_order_relaxed, memory_order_relaxed)) break;
+    }
+    else if (diff < 0) return 1;
+    else pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+  }
+
+  kv_set_clear(s->set);
+  while ( (kv = kv_next(set, kv))) kv_add(s->set, kv->key, kv->klen, kv->val, kv->vlen);
+  atomic_store(&s->seq, pos + 1);
+
+  if (atomic_load(&q->sleeping)) {
+    pthread_mutex_lock(&q->mutex);
+    pthread_cond_signal(&q->wake);
+    pthread_mutex_unlock(&q->mutex);
+  }
+  return 0;
+}
+
+int kv_async_write(kvspw_t *w, kvset_t *set) {
+  kvaq_t *q = w->aq;
+
+  if (atomic_load(&q->err)) return -1;
+
+  while (aq_push(q, set)) {
+    if (q->policy == KV_ASYNC_DROP) {
+      atomic_fetch_add(&q->dropped, 1);
+      return 0;
+    }
+    pthread_mutex_lock(&q->mutex);
+    atomic_fetch_add(&q->waiters, 1);
+    while (!slot_free(q) && !atomic_load(&q->err))
+      pthread_cond_wait(&q->idle, &q->mutex);
+    atomic_fetch_sub(&q->waiters, 1);
+    pthread_mutex_unlock(&q->mutex);
+    if (atomic_load(&q->err)) return -1;
+  }
+
+  return 0;
+}
+
+/* wait til every set queued before the call is in the spool */
+int kv_spool_flush(void *_sp) {
+  kvspw_t *w = (kvspw_t*)_sp;
+  kvaq_t *q = w->aq;
+  size_t target;
+
+  if (q == NULL) return 0;
+
+  target = atomic_load(&q->head);
+  pthread_mutex_lock(&q->mutex);
+  atomic_fetch_add(&q->waiters, 1);
+  while (atomic_load(&q->done) < target) pthread_cond_wait(&q->idle, &q->mutex);
+  atomic_fetch_sub(&q->waiters, 1);
+  pthread_mutex_unlock(&q->mutex);
+
+  return atomic_load(&q->err) ? -1 : 0;
+}
+
+size_t kv_spoolwriter_dropped(void *_sp) {
+  kvspw_t *w = (kvspw_t*)_sp;
+  return w->aq ? atomic_load(&w->aq->dropped) : 0;
+}
+
+static void aq_free(kvaq_t *q) {
+  size_t i;
+  for(i=0; i < q->depth; i++) if (q->slots[i].set) kv_set_free(q->slots[i].set);
+  pthread_mutex_destroy(&q->mutex);
+  pthread_cond_destroy(&q->wake);
+  pthread_cond_destroy(&q->idle);
+  free(q->slots);
+  free(q);
+}
+
+void *kv_spoolwriter_new_async(const char *dir, int depth, int policy) {
+  kvspw_t *w = NULL;
+  kvaq_t *q = NULL;
+  size_t i, d;
+
+  if (depth <= 0) goto fail;
+  for(d=1; d < (size_t)depth; d <<= 1) ;
+
+  if ( (w = kv_spoolwriter_new(dir)) == NULL) goto fail;
+  if ( (q = calloc(1, sizeof(*q))) == NULL) goto oom;
+  if ( (q->slots = calloc(d, sizeof(*q->slots))) == NULL) goto oom;
+  if ( (w->iov = calloc(d, sizeof(*w->iov))) == NULL) goto oom;
+  w->iovn = d;
+  q->depth = d;
+  q->mask = d - 1;
+  q->policy = policy;
+  for(i=0; i < d; i++) {
+    atomic_init(&q->slots[i].seq, i);
+    if ( (q->slots[i].set = kv_set_new_arena(KV_ASYNC_SETSZ)) == NULL) goto oom;
+  }
+  pthread_mutex_init(&q->mutex, NULL);
+  pthread_cond_init(&q->wake, NULL);
+  pthread_cond_init(&q->idle, NULL);
+
+  w->aq = q;
+  if (pthread_create(&q->thread, NULL, writer_thread, w)) {
+    fprintf(stderr, "pthread_create: error\n");
+    w->aq = NULL;
+    aq_free(q);
+    q = NULL;
+    goto fail;
+  }
+  return w;
+
+ oom:
+  fprintf(stderr, "out of memory\n");
+ fail:
+  if (q) {
+    if (q->slots) {
+      for(i=0; i < q->depth; i++) if (q->slots[i].set) kv_set_free(q->slots[i].set);
+      free(q->slots);
+    }
+    free(q);
+  }
+  if (w) kv_spoolwriter_free(w);
+  return NULL;
+}
+
+/* drain the queue and stop the writer thread */
+void kv_async_stop(kvspw_t *w) {
+  kvaq_t *q = w->aq;
+
+  pthread_mutex_lock(&q->mutex);
+  q->stop = 1;
+  pthread_cond_signal(&q->wake);
+  pthread_mutex_unlock(&q->mutex);
+  pthread_join(q->thread, NULL);
+
+  aq_free(q);
+  w->aq = NULL;
+}
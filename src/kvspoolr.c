@@ -7,42 +7,86 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
 #include <dirent.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include "kvspool.h"
 #include "kvspool_internal.h"
 #include "utstring.h"
-#include "tpl.h"
 #include "shr.h"
 
-static void fill_set(void *img, size_t sz, kvset_t *set) {
-  tpl_node *tn;
-  char *key;
-  char *val;
+/* is key in the reader's projection (if it has one) */
+static int projected(kvspr_t *r, char *key, int klen) {
+  int i;
+  if (r->nproj == 0) return 1;
+  for(i=0; i < r->nproj; i++) {
+    if ((r->proj[i].klen == klen) && !memcmp(r->proj[i].key, key, klen)) return 1;
+  }
+  return 0;
+}
+
+/* start the walk over a frame image. a frame that fails to open walks 
+ * as empty */
+static int open_frame(kv_frame_t *f, char *img, size_t sz, int view) {
+  if (kv_frame_open(f, img, sz, view) < 0) {
+    fprintf(stderr, "frame decode failed (sz %d)\n", (int)sz);
+    f->n = 0;
+    return -1;
+  }
+  return 0;
+}
+
+/* decode an opened frame into the set. in view mode the pairs point into
+ * the image itself (which gets nul-terminated in place) instead of being
+ * copied out of it; the image must then outlive the set contents */
+static void fill_set(kvspr_t *r, kv_frame_t *f, kvset_t *set, int view) {
+  char *key, *val;
+  int klen, vlen, sc;
 
   kv_set_clear(set);
 
-  tn = tpl_map("A(ss)", &key, &val);
-  if (tpl_load(tn, TPL_MEM, img, sz) == -1) {
-    fprintf(stderr, "tpl_load failed (sz %d)\n", (int)sz);
-    return;
+  while ( (sc = kv_frame_next(f, &key, &klen, &val, &vlen)) > 0) {
+    if (!projected(r, key, klen)) continue;
+    if (view) kv_add_view(set, key, klen, val, vlen);
+    else kv_add(set, key, klen, val, vlen);
   }
-  while( tpl_unpack(tn,1) > 0 ) {
-    kv_adds(set, key, val);
-    free(key);
-    free(val);
-  }
-  tpl_free(tn);
+  if (sc < 0) fprintf(stderr, "frame truncated\n");
 }
 
 /*******************************************************************************
  * Spool reader API
  ******************************************************************************/
+#define KV_READ_BUFSZ 4096
+#define KV_MAXFRAME (10*1024*1024)
+#define KV_BATCH (10*1024*1024)
+#define KV_HUGEPAGE (2*1024*1024)
+
+static kvspr_t *reader_new(struct shr *shr) {
+  kvspr_t *r;
+  if (shr == NULL) return NULL;
+  if ( (r = calloc(1, sizeof(*r))) == NULL) goto oom;
+  r->bsz = KV_READ_BUFSZ + 1; /* one spare byte for view termination */
+  if ( (r->buf = malloc(r->bsz)) == NULL) goto oom;
+  r->maxframe = KV_MAXFRAME;
+  r->batch = KV_BATCH;
+  r->shr = shr;
+  return r;
+
+ oom:
+  fprintf(stderr, "out of memory\n");
+  if (r) free(r);
+  shr_close(shr);
+  return NULL;
+}
+
 void *kv_spoolreader_new(const char *dir) {
   char path[PATH_MAX];
   struct shr *shr;
   snprintf(path, PATH_MAX, "%s/%s", dir, "data");
   shr = shr_open(path, SHR_RDONLY);
-  return shr;
+  return reader_new(shr);
 }
 
 void *kv_spoolreader_new_nb(const char *dir, int *fd) {
@@ -58,61 +102,528 @@ void *kv_spoolreader_new_nb(const char *dir, int *fd) {
   rc = 0;
 
  done:
-  return shr;
+  return reader_new(shr);
 }
 
-/* returns 1 if frame ready, 0 = no data (nonblocking), or -1 on error 
- * whether or not its a blocking or non-blocking read depends on the
- * way it was opened (kv_spoolreader_new or with _nb suffix)
- */
-int kv_spool_read(void *_sp, void *_set, int obsolete_blocking_flag) {
-  struct shr *shr = (struct shr *)_sp;
-  kvset_t *set = (kvset_t*)_set;
-  char buf[4096];
+/* set the largest frame a reader accepts. the receive buffer grows on
+ * demand up to this size and then stays at the largest size needed */
+void kv_spoolreader_maxframe(void *_sp, size_t maxframe) {
+  kvspr_t *r = (kvspr_t*)_sp;
+  r->maxframe = maxframe;
+}
+
+/* a frame too big for the receive buffer fails the read without being 
+ * consumed; grow the buffer (doubling, up to the cap) and try again */
+static int grow_buf(kvspr_t *r) {
+  size_t sz = r->bsz - 1;
+  char *buf;
+
+  if (sz >= r->maxframe) return -1;
+  sz = (2*sz < r->maxframe) ? 2*sz : r->maxframe;
+  if ( (buf = realloc(r->buf, sz + 1)) == NULL) {
+    fprintf(stderr, "out of memory\n");
+    return -1;
+  }
+  r->buf = buf;
+  r->bsz = sz + 1;
+  return 0;
+}
+
+/* frames that fail the reader's filter are read past without decoding */
+static int spool_read(kvspr_t *r, kvset_t *set, int view) {
+  kv_frame_t f;
   ssize_t sc;
 
-  sc = shr_read(shr, buf, sizeof(buf));
+ again:
+  do {
+    sc = shr_read(r->shr, r->buf, r->bsz - 1);
+  } while ((sc < 0) && (grow_buf(r) == 0));
   if (sc > 0) {
-    fill_set(buf, sc, set);
+    if (r->filter && !kv_filter_match(r, r->buf, sc)) goto again;
+    open_frame(&f, r->buf, sc, view);
+    fill_set(r, &f, set, view);
     return 1;
   }
   return sc; /* negative (error) or 0 (no data) case */
 }
 
-int kv_spool_readN(void *_sp, void **_setv, int *nset) {
-  struct shr *shr = (struct shr *)_sp;
-  kvset_t **setv = (kvset_t**)_setv;
+/* read the next frame image without decoding it. *img points into the
+ * reader's buffer and stays valid until the next read. the filter, if
+ * any, applies; the projection does not. returns as kv_spool_read */
+int kv_spool_read_raw(void *_sp, char **img, size_t *len) {
+  kvspr_t *r = (kvspr_t*)_sp;
   ssize_t sc;
-  char *tmp=NULL;
 
+  do {
+    do {
+      sc = shr_read(r->shr, r->buf, r->bsz - 1);
+    } while ((sc < 0) && (grow_buf(r) == 0));
+  } while ((sc > 0) && r->filter && !kv_filter_match(r, r->buf, sc));
+
+  if (sc <= 0) return sc;
+  *img = r->buf;
+  *len = sc;
+  return 1;
+}
+
+/* returns 1 if frame ready, 0 = no data (nonblocking), or -1 on error 
+ * whether or not its a blocking or non-blocking read depends on the
+ * way it was opened (kv_spoolreader_new or with _nb suffix)
+ */
+int kv_spool_read(void *_sp, void *_set, int obsolete_blocking_flag) {
+  return spool_read((kvspr_t*)_sp, (kvset_t*)_set, 0);
+}
+
+/* like kv_spool_read, but the set's keys and values point into the
+ * reader's copy of the frame. they stay valid until the next read */
+int kv_spool_read_view(void *_sp, void *_set) {
+  return spool_read((kvspr_t*)_sp, (kvset_t*)_set, 1);
+}
+
+static void free_proj(kvspr_t *r) {
   int i;
-  size_t iovcnt = *nset;
-  struct iovec iov[iovcnt];
-  *nset = 0;
+  for(i=0; i < r->nproj; i++) free(r->proj[i].key);
+  if (r->proj) free(r->proj);
+  r->proj = NULL;
+  r->nproj = 0;
+}
+
+/* restrict the pairs that reads put in the set to the n given keys; the
+ * other pairs of each frame are skipped over. n of 0 reads all pairs */
+int kv_spoolreader_project(void *_sp, const char **keys, int n) {
+  kvspr_t *r = (kvspr_t*)_sp;
+  int i;
+
+  free_proj(r);
+  if (n <= 0) return 0;
+  if ( (r->proj = calloc(n, sizeof(*r->proj))) == NULL) goto oom;
+  for(i=0; i < n; i++) {
+    if ( (r->proj[i].key = strdup(keys[i])) == NULL) goto oom;
+    r->proj[i].klen = strlen(keys[i]);
+    r->nproj++;
+  }
+  return 0;
+
+ oom:
+  fprintf(stderr, "out of memory\n");
+  free_proj(r);
+  return -1;
+}
+
+/* the reader takes over the filter, freeing it with the reader or when
+ * replaced. a NULL filter passes every frame */
+int kv_spoolreader_filter(void *_sp, void *f) {
+  kvspr_t *r = (kvspr_t*)_sp;
+  kvfilt_t **leaves = NULL;
+  int n = 0;
+
+  if (f) {
+    n = kv_filter_leaves(f, NULL);
+    if ( (leaves = calloc(n, sizeof(*leaves))) == NULL) {
+      fprintf(stderr, "out of memory\n");
+      return -1;
+    }
+    kv_filter_leaves(f, leaves);
+  }
+  if (r->filter) kv_filter_free(r->filter);
+  if (r->leaves) free(r->leaves);
+  r->filter = f;
+  r->leaves = leaves;
+  r->nleaves = n;
+  return 0;
+}
+
+static int alloc_batch(kvspr_t *r) {
+  size_t sz = r->batch + 1; /* one spare byte for view termination */
+  void *p;
 
-  int tmpsz = 10*1024*1024;
-  tmp = malloc(tmpsz);
-  if (tmp == NULL) {
+  if (r->hugepages) {
+    sz = (sz + KV_HUGEPAGE - 1) & ~(KV_HUGEPAGE - 1);
+    p = mmap(NULL, sz, PROT_READ|PROT_WRITE, 
+             MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+    if (p == MAP_FAILED) { /* no hugetlb pages reserved; ask for THP */
+      p = mmap(NULL, sz, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+      if (p == MAP_FAILED) {
+        fprintf(stderr, "mmap: %s\n", strerror(errno));
+        return -1;
+      }
+      madvise(p, sz, MADV_HUGEPAGE);
+    }
+  } else if ( (p = malloc(sz)) == NULL) {
     fprintf(stderr, "out of memory\n");
-    goto done;
+    return -1;
+  }
+  r->bbuf = p;
+  r->bbsz = sz;
+  return 0;
+}
+
+static void free_batch(kvspr_t *r) {
+  if (r->bbuf == NULL) return;
+  if (r->hugepages) munmap(r->bbuf, r->bbsz);
+  else free(r->bbuf);
+  r->bbuf = NULL;
+  r->bbsz = 0;
+}
+
+/* set the byte budget of a batch read, that is, the size of the scratch 
+ * region that kv_spool_readN reads frames into. the region is allocated
+ * on first use and kept for the life of the reader. with hugepages set,
+ * it is mapped from huge pages if the system has them available */
+void kv_spoolreader_batch(void *_sp, size_t bytes, int hugepages) {
+  kvspr_t *r = (kvspr_t*)_sp;
+  free_batch(r);
+  r->batch = bytes;
+  r->hugepages = hugepages;
+}
+
+/*******************************************************************************
+ * Parallel batch decode
+ *
+ * a reader given n threads decodes the frames of a batch read on n threads:
+ * the caller and a pool of n-1 workers. the frames are opened first, on the
+ * caller, in order; that reads each header before any view termination can
+ * overwrite its first byte, so afterward the frames can be decoded in any
+ * order. the threads then take chunks of frames off a shared counter, each
+ * frame going into its own set of the caller's array, til none are left.
+ * the caller returns once every worker is done with the batch.
+ ******************************************************************************/
+#define KV_DECODE_CHUNK 64  /* frames taken at a time by a decode thread */
+#define KV_DECODE_MIN 256   /* smaller batches are decoded on the caller */
+
+struct kvdp {
+  kvspr_t *r;
+  pthread_t *thread;
+  int nthread;            /* workers, besides the caller */
+  pthread_mutex_t mutex;
+  pthread_cond_t go;      /* wakes the workers for a batch */
+  pthread_cond_t done;    /* wakes the caller when the last worker is done */
+  unsigned gen;           /* batch number */
+  int busy;               /* workers still on the batch */
+  int stop;
+  kv_frame_t *f;          /* opened frames of the batch */
+  size_t fn;              /* allocated length of f */
+  kvset_t **setv;
+  size_t n;               /* frames in the batch */
+  int view;
+  atomic_size_t next;     /* next frame to take */
+};
+
+static void decode_chunks(kvdp_t *p) {
+  size_t i, e;
+  for(;;) {
+    i = atomic_fetch_add(&p->next, KV_DECODE_CHUNK);
+    if (i >= p->n) break;
+    e = (i + KV_DECODE_CHUNK < p->n) ? i + KV_DECODE_CHUNK : p->n;
+    for(; i < e; i++) fill_set(p->r, &p->f[i], p->setv[i], p->view);
+  }
+}
+
+static void *decode_thread(void *_p) {
+  kvdp_t *p = (kvdp_t*)_p;
+  unsigned gen = 0;
+
+  for(;;) {
+    pthread_mutex_lock(&p->mutex);
+    while ((p->gen == gen) && !p->stop) pthread_cond_wait(&p->go, &p->mutex);
+    if (p->stop) {
+      pthread_mutex_unlock(&p->mutex);
+      break;
+    }
+    gen = p->gen;
+    pthread_mutex_unlock(&p->mutex);
+
+    decode_chunks(p);
+
+    pthread_mutex_lock(&p->mutex);
+    if (--p->busy == 0) pthread_cond_signal(&p->done);
+    pthread_mutex_unlock(&p->mutex);
+  }
+  return NULL;
+}
+
+/* returns 0 once the batch is decoded, -1 if it was not (out of memory) */
+static int pool_decode(kvspr_t *r, kvset_t **setv, size_t n, int view) {
+  kvdp_t *p = r->dp;
+  kv_frame_t *f;
+  size_t i;
+
+  if (n > p->fn) {
+    if ( (f = realloc(p->f, n * sizeof(*f))) == NULL) {
+      fprintf(stderr, "out of memory\n");
+      return -1;
+    }
+    p->f = f;
+    p->fn = n;
+  }
+  for(i=0; i < n; i++) open_frame(&p->f[i], r->iov[i].iov_base, r->iov[i].iov_len, view);
+
+  p->setv = setv;
+  p->n = n;
+  p->view = view;
+  atomic_store(&p->next, 0);
+
+  pthread_mutex_lock(&p->mutex);
+  p->gen++;
+  p->busy = p->nthread;
+  pthread_cond_broadcast(&p->go);
+  pthread_mutex_unlock(&p->mutex);
+
+  decode_chunks(p);
+
+  pthread_mutex_lock(&p->mutex);
+  while (p->busy) pthread_cond_wait(&p->done, &p->mutex);
+  pthread_mutex_unlock(&p->mutex);
+  return 0;
+}
+
+static void pool_free(kvdp_t *p) {
+  int i;
+  pthread_mutex_lock(&p->mutex);
+  p->stop = 1;
+  pthread_cond_broadcast(&p->go);
+  pthread_mutex_unlock(&p->mutex);
+  for(i=0; i < p->nthread; i++) pthread_join(p->thread[i], NULL);
+
+  pthread_mutex_destroy(&p->mutex);
+  pthread_cond_destroy(&p->go);
+  pthread_cond_destroy(&p->done);
+  if (p->f) free(p->f);
+  free(p->thread);
+  free(p);
+}
+
+/* decode batch reads on n threads (the caller and n-1 workers). n of 1
+ * goes back to decoding on the caller alone */
+int kv_spoolreader_threads(void *_sp, int n) {
+  kvspr_t *r = (kvspr_t*)_sp;
+  kvdp_t *p;
+
+  if (r->dp) pool_free(r->dp);
+  r->dp = NULL;
+  if (n <= 1) return 0;
+
+  if ( (p = calloc(1, sizeof(*p))) == NULL) goto oom;
+  if ( (p->thread = calloc(n-1, sizeof(*p->thread))) == NULL) {
+    free(p);
+    goto oom;
+  }
+  p->r = r;
+  pthread_mutex_init(&p->mutex, NULL);
+  pthread_cond_init(&p->go, NULL);
+  pthread_cond_init(&p->done, NULL);
+  for(p->nthread=0; p->nthread < n-1; p->nthread++) {
+    if (pthread_create(&p->thread[p->nthread], NULL, decode_thread, p)) {
+      fprintf(stderr, "pthread_create: error\n");
+      pool_free(p);
+      return -1;
+    }
   }
+  r->dp = p;
+  return 0;
+
+ oom:
+  fprintf(stderr, "out of memory\n");
+  return -1;
+}
 
-  sc = shr_readv(shr, tmp, tmpsz, iov, &iovcnt);
+static int spool_readN(kvspr_t *r, kvset_t **setv, int *nset, int view) {
+  struct iovec *iov;
+  kv_frame_t f;
+  ssize_t sc = -1;
+  size_t iovcnt;
+  int i, n;
+
+  iovcnt = *nset;
+  *nset = 0;
+
+  if ((r->bbuf == NULL) && (alloc_batch(r) < 0)) goto done;
+  if (iovcnt > r->iovn) {
+    if ( (iov = realloc(r->iov, iovcnt * sizeof(*iov))) == NULL) {
+      fprintf(stderr, "out of memory\n");
+      goto done;
+    }
+    r->iov = iov;
+    r->iovn = iovcnt;
+  }
+
+  sc = shr_readv(r->shr, r->bbuf, r->bbsz - 1, r->iov, &iovcnt);
   if (sc <= 0) goto done;
 
-  for(i=0; i < iovcnt; i++) {
-    fill_set(iov[i].iov_base, iov[i].iov_len, setv[i]);
+  /* drop the frames that fail the filter; this test doesn't modify them */
+  if (r->filter) {
+    for(i=0, n=0; i < iovcnt; i++) {
+      if (!kv_filter_match(r, r->iov[i].iov_base, r->iov[i].iov_len)) continue;
+      r->iov[n++] = r->iov[i];
+    }
+    iovcnt = n;
+  }
+
+  if (r->dp && (iovcnt >= KV_DECODE_MIN) && 
+      (pool_decode(r, setv, iovcnt, view) == 0)) {
+    *nset = iovcnt;
+    goto done;
+  }
+
+  /* frames are back to back in bbuf, and terminating the last val of a 
+   * view writes the first byte of the next frame. so decode in reverse */
+  for(i=iovcnt-1; i >= 0; i--) {
+    open_frame(&f, r->iov[i].iov_base, r->iov[i].iov_len, view);
+    fill_set(r, &f, setv[i], view);
   }
   *nset = iovcnt;
 
  done:
-  if (tmp) free(tmp);
   return sc;
 }
 
+int kv_spool_readN(void *_sp, void **_setv, int *nset) {
+  return spool_readN((kvspr_t*)_sp, (kvset_t**)_setv, nset, 0);
+}
+
+/* like kv_spool_readN, but the sets' keys and values point into the
+ * reader's copy of the frames. they stay valid until the next read */
+int kv_spool_readN_view(void *_sp, void **_setv, int *nset) {
+  return spool_readN((kvspr_t*)_sp, (kvset_t**)_setv, nset, 1);
+}
+
 void kv_spoolreader_free(void *_sp) {
-  struct shr *shr = (struct shr *)_sp;
-  shr_close(shr);
+  kvspr_t *r = (kvspr_t*)_sp;
+  shr_close(r->shr);
+  free_batch(r);
+  free_proj(r);
+  kv_spoolreader_filter(r, NULL);
+  kv_spoolreader_threads(r, 0);
+  if (r->iov) free(r->iov);
+  free(r->buf);
+  free(r);
+}
+
+/*******************************************************************************
+ * Multi-spool reader
+ *
+ * reads several spools from one thread. each spool has a nonblocking reader
+ * whose selectable fd is in one epoll set. sources are served round-robin; a
+ * source of weight w gets up to w reads in a row before its turn passes on.
+ * a source that reads empty is skipped until epoll says it's readable again,
+ * and epoll is only consulted once every source has read empty.
+ ******************************************************************************/
+void *kv_spoolreader_multi_new(const char **dirs, int n, int *fd) {
+  struct epoll_event ev;
+  kvspm_t *m;
+  int i, sfd;
+
+  if (n <= 0) return NULL;
+  if ( (m = calloc(1, sizeof(*m))) == NULL) goto oom;
+  m->epfd = -1;
+  if ( (m->r = calloc(n, sizeof(*m->r))) == NULL) goto oom;
+  if ( (m->weight = calloc(n, sizeof(*m->weight))) == NULL) goto oom;
+  if ( (m->ready = calloc(n, sizeof(*m->ready))) == NULL) goto oom;
+  if ( (m->ev = calloc(n, sizeof(*m->ev))) == NULL) goto oom;
+  m->n = n;
+  m->blocking = fd ? 0 : 1;
+
+  if ( (m->epfd = epoll_create(n)) == -1) {
+    fprintf(stderr, "epoll_create: %s\n", strerror(errno));
+    goto fail;
+  }
+
+  for(i=0; i < n; i++) {
+    if ( (m->r[i] = kv_spoolreader_new_nb(dirs[i], &sfd)) == NULL) {
+      fprintf(stderr, "failed to open spool %s\n", dirs[i]);
+      goto fail;
+    }
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.u32 = i;
+    if (epoll_ctl(m->epfd, EPOLL_CTL_ADD, sfd, &ev) == -1) {
+      fprintf(stderr, "epoll_ctl: %s\n", strerror(errno));
+      goto fail;
+    }
+    m->weight[i] = 1;
+    m->ready[i] = 1;
+  }
+  m->credit = m->weight[0];
+
+  if (fd) *fd = m->epfd;
+  return m;
+
+ oom:
+  fprintf(stderr, "out of memory\n");
+ fail:
+  if (m) kv_spoolreader_multi_free(m);
+  return NULL;
+}
+
+/* source src gets up to weight reads per turn (default 1) */
+void kv_spoolreader_multi_weight(void *_sp, int src, int weight) {
+  kvspm_t *m = (kvspm_t*)_sp;
+  if ((src < 0) || (src >= m->n) || (weight < 1)) return;
+  m->weight[src] = weight;
+  if (src == m->cur) m->credit = weight;
+}
+
+static void multi_next(kvspm_t *m) {
+  m->cur = (m->cur + 1) % m->n;
+  m->credit = m->weight[m->cur];
+}
+
+static int multi_read(kvspm_t *m, kvset_t *set, int *src, int view) {
+  int i, sc, nev, polled=0;
+
+  for(;;) {
+
+    for(i=0; i < m->n; i++) {
+      if (m->ready[m->cur]) {
+        sc = spool_read(m->r[m->cur], set, view);
+        if (sc < 0) return -1;
+        if (sc > 0) {
+          if (src) *src = m->cur;
+          if (--m->credit == 0) multi_next(m);
+          return 1;
+        }
+        m->ready[m->cur] = 0;
+      }
+      multi_next(m);
+    }
+
+    /* every source read empty. wait for any to become readable. a
+     * nonblocking read polls once, so a spurious wakeup can't spin it */
+    if (!m->blocking && polled++) return 0;
+    nev = epoll_wait(m->epfd, m->ev, m->n, m->blocking ? -1 : 0);
+    if (nev < 0) {
+      if (errno != EINTR) fprintf(stderr, "epoll_wait: %s\n", strerror(errno));
+      return -1;
+    }
+    if (nev == 0) return 0;
+    for(i=0; i < nev; i++) m->ready[m->ev[i].data.u32] = 1;
+  }
+}
+
+/* returns 1 with a frame from spool *src, 0 = no data (nonblocking), or
+ * -1 on error. the reader is nonblocking if opened with a non-NULL fd */
+int kv_spool_multi_read(void *_sp, void *_set, int *src) {
+  return multi_read((kvspm_t*)_sp, (kvset_t*)_set, src, 0);
+}
+
+/* like kv_spool_multi_read, but the set's keys and values point into the
+ * reader's copy of the frame. they stay valid until the next read */
+int kv_spool_multi_read_view(void *_sp, void *_set, int *src) {
+  return multi_read((kvspm_t*)_sp, (kvset_t*)_set, src, 1);
+}
+
+void kv_spoolreader_multi_free(void *_sp) {
+  kvspm_t *m = (kvspm_t*)_sp;
+  int i;
+  if (m->r) {
+    for(i=0; i < m->n; i++) if (m->r[i]) kv_spoolreader_free(m->r[i]);
+    free(m->r);
+  }
+  if (m->epfd != -1) close(m->epfd);
+  if (m->weight) free(m->weight);
+  if (m->ready) free(m->ready);
+  if (m->ev) free(m->ev);
+  free(m);
 }
 
 /* get the percentage consumed for dir 
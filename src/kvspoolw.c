@@ -10,7 +10,6 @@
 
 #include "utstring.h"
 #include "utarray.h"
-#include "tpl.h"
 #include "shr.h"
 
 #include "kvspool.h"
@@ -20,35 +19,76 @@
 /*******************************************************************************
  * Spool writer API
  ******************************************************************************/
+#define KV_WRITE_BUFSZ 4096
+
 void *kv_spoolwriter_new(const char *dir) {
   char path[PATH_MAX];
   struct shr *shr;
+  kvspw_t *w;
   snprintf(path, PATH_MAX, "%s/%s", dir, "data");
   shr = shr_open(path, SHR_WRONLY);
-  return shr;
+  if (shr == NULL) return NULL;
+  if ( ((w = calloc(1, sizeof(*w))) == NULL) ||
+       ((w->buf = malloc(KV_WRITE_BUFSZ)) == NULL)) {
+    fprintf(stderr, "out of memory\n");
+    if (w) free(w);
+    shr_close(shr);
+    return NULL;
+  }
+  w->bsz = KV_WRITE_BUFSZ;
+  w->shr = shr;
+  return w;
+}
+
+/* make room for at least len bytes in the handle buffer */
+static int grow_buf(kvspw_t *w, size_t len) {
+  char *buf;
+
+  if (len <= w->bsz) return 0;
+  if (len < 2*w->bsz) len = 2*w->bsz;
+  if ( (buf = realloc(w->buf, len)) == NULL) {
+    fprintf(stderr, "out of memory\n");
+    return -1;
+  }
+  w->buf = buf;
+  w->bsz = len;
+  return 0;
+}
+
+/* encode set into the handle buffer at off, growing it if the frame 
+ * doesn't fit. returns the frame length, or 0 on error */
+size_t kv_spool_encode(kvspw_t *w, size_t off, kvset_t *set) {
+  size_t len;
+
+  len = kv_frame_encode(set, w->buf + off, w->bsz - off);
+  if (len) return len;
+
+  if (grow_buf(w, off + kv_frame_len(set)) < 0) return 0;
+  return kv_frame_encode(set, w->buf + off, w->bsz - off);
+}
+
+/* a reserved frame lives in the handle buffer until commit or abort */
+static int reserved(kvspw_t *w, const char *fn) {
+  if (w->rsv == 0) return 0;
+  fprintf(stderr, "%s: frame reserved; commit or abort it first\n", fn);
+  return -1;
 }
 
 int kv_spool_write(void*_sp, void *_set) {
-  struct shr *shr = (struct shr *)_sp;
+  kvspw_t *w = (kvspw_t*)_sp;
   kvset_t *set = (kvset_t*)_set;
-  tpl_node *tn = NULL;
-  char *buf=NULL; 
-  char *key, *val;
   size_t len;
   ssize_t sc;
   int rc=-1;
 
+  if (w->aq) return kv_async_write(w, set);
+  if (reserved(w, "kv_spool_write") < 0) goto done;
+
   /* generate frame */
-  tn = tpl_map("A(ss)", &key, &val);
-  kv_t *kv = NULL;
-  while ( (kv = kv_next(set, kv))) {
-    key = kv->key;
-    val = kv->val;
-    tpl_pack(tn,1);
-  }
+  len = kv_spool_encode(w, 0, set);
+  if (len == 0) goto done;
 
-  tpl_dump(tn, TPL_MEM, &buf, &len);
-  sc = shr_write(shr, buf, len);
+  sc = shr_write(w->shr, w->buf, len);
   if (sc <= 0) {
     fprintf(stderr, "shr_write: error\n");
     goto done;
@@ -57,40 +97,69 @@ int kv_spool_write(void*_sp, void *_set) {
   rc=0;
 
  done:
-  tpl_free(tn);
-  if (buf) free(buf);
   return rc;
 }
 
+/* write a frame image as is, e.g. one from kv_spool_read_raw */
+int kv_spool_write_raw(void *_sp, const char *img, size_t len) {
+  kvspw_t *w = (kvspw_t*)_sp;
+  kv_frame_t f;
+  ssize_t sc;
+
+  if (w->aq) {
+    fprintf(stderr, "kv_spool_write_raw: not supported on async writer\n");
+    return -1;
+  }
+  if (reserved(w, "kv_spool_write_raw") < 0) return -1;
+  if (kv_frame_open(&f, (char*)img, len, 0) < 0) {
+    fprintf(stderr, "kv_spool_write_raw: not a frame image\n");
+    return -1;
+  }
+
+  sc = shr_write(w->shr, (char*)img, len);
+  if (sc <= 0) {
+    fprintf(stderr, "shr_write: error\n");
+    return -1;
+  }
+  return 0;
+}
+
+/* the frames are encoded back to back into the handle buffer, which 
+ * grows to fit the largest batch, and go out in one vectored write */
 int kv_spool_writeN(void *_sp, void **_setv, int nset) {
-  struct shr *shr = (struct shr *)_sp;
+  kvspw_t *w = (kvspw_t*)_sp;
   kvset_t **setv = (kvset_t**)_setv;
-  struct iovec *iov=NULL;
-  tpl_node *tn = NULL;
+  struct iovec *iov;
   int i, rc = -1, sc;
-  char *key, *val;
+  size_t off = 0;
 
-  iov = malloc(sizeof(struct iovec) * nset);
-  if (iov == NULL) {
-    fprintf(stderr, "out of memory\n");
-    goto done;
+  if (w->aq) {
+    for(i=0; i < nset; i++) if (kv_async_write(w, setv[i]) < 0) goto done;
+    return 0;
   }
+  if (reserved(w, "kv_spool_writeN") < 0) goto done;
 
+  if (nset > w->iovn) {
+    if ( (iov = realloc(w->iov, nset * sizeof(*iov))) == NULL) {
+      fprintf(stderr, "out of memory\n");
+      goto done;
+    }
+    w->iov = iov;
+    w->iovn = nset;
+  }
 
+  /* the buffer may move as it grows, so point the iovecs into it after */
   for(i=0; i < nset; i++) {
-    tn = tpl_map("A(ss)", &key, &val);
-    kv_t *kv = NULL;
-    while ( (kv = kv_next(setv[i], kv))) {
-      key = kv->key;
-      val = kv->val;
-      tpl_pack(tn,1);
-    }
-    tpl_dump(tn, TPL_MEM, &iov[i].iov_base, &iov[i].iov_len);
-    tpl_free(tn);
-    tn = NULL;
+    w->iov[i].iov_len = kv_spool_encode(w, off, setv[i]);
+    if (w->iov[i].iov_len == 0) goto done;
+    off += w->iov[i].iov_len;
+  }
+  for(off=0, i=0; i < nset; i++) {
+    w->iov[i].iov_base = w->buf + off;
+    off += w->iov[i].iov_len;
   }
 
-  sc = shr_writev(shr, iov, nset);
+  sc = shr_writev(w->shr, w->iov, nset);
   if (sc <= 0) {
     fprintf(stderr, "shr_writev: error\n");
     goto done;
@@ -99,14 +168,65 @@ int kv_spool_writeN(void *_sp, void **_setv, int nset) {
   rc = 0;
  
  done:
-  if (iov) {
-    for(i=0; i < nset; i++) free(iov[i].iov_base);
-    free(iov);
-  }
   return rc;
 }
 
+/* two-phase write. the frame is built in the handle buffer: shr has no
+ * way to hand out space in the ring itself, so commit copies it in */
+char *kv_spool_reserve(void *_sp, size_t maxlen) {
+  kvspw_t *w = (kvspw_t*)_sp;
+
+  if (w->aq) {
+    fprintf(stderr, "kv_spool_reserve: not supported on async writer\n");
+    return NULL;
+  }
+  if (w->rsv) {
+    fprintf(stderr, "kv_spool_reserve: frame already reserved\n");
+    return NULL;
+  }
+  if ((maxlen == 0) || (grow_buf(w, maxlen) < 0)) return NULL;
+  w->rsv = maxlen;
+  return w->buf;
+}
+
+int kv_spool_commit(void *_sp, size_t used) {
+  kvspw_t *w = (kvspw_t*)_sp;
+  size_t rsv = w->rsv;
+  kv_frame_t f;
+  ssize_t sc;
+
+  w->rsv = 0;
+  if (rsv == 0) {
+    fprintf(stderr, "kv_spool_commit: no frame reserved\n");
+    return -1;
+  }
+  if ((used == 0) || (used > rsv)) {
+    fprintf(stderr, "kv_spool_commit: bad frame length %zu\n", used);
+    return -1;
+  }
+  if (kv_frame_open(&f, w->buf, used, 0) < 0) {
+    fprintf(stderr, "kv_spool_commit: not a frame image\n");
+    return -1;
+  }
+
+  sc = shr_write(w->shr, w->buf, used);
+  if (sc <= 0) {
+    fprintf(stderr, "shr_write: error\n");
+    return -1;
+  }
+  return 0;
+}
+
+void kv_spool_abort(void *_sp) {
+  kvspw_t *w = (kvspw_t*)_sp;
+  w->rsv = 0;
+}
+
 void kv_spoolwriter_free(void*_sp) {
-  struct shr *shr = (struct shr *)_sp;
-  shr_close(shr);
+  kvspw_t *w = (kvspw_t*)_sp;
+  if (w->aq) kv_async_stop(w);
+  shr_close(w->shr);
+  if (w->iov) free(w->iov);
+  free(w->buf);
+  free(w);
 }
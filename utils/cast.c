@@ -0,0 +1,287 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <arpa/inet.h>
+#include "cast.h"
+
+/*******************************************************************************
+ * cast value conversions
+ *
+ * the binary casts used to parse with atoi, atof, sscanf and inet_pton and
+ * format with printf and inet_ntoa. these do the common cases in a loop
+ * over the bytes, with no locale lookups, copies or allocation, and they
+ * check the whole value: trailing junk or an out of range number is an
+ * error rather than being ignored or wrapped.
+ ******************************************************************************/
+
+static int is_digit(char c) { return (c >= '0') && (c <= '9'); }
+
+static int hex_val(char c) {
+  if ((c >= '0') && (c <= '9')) return c - '0';
+  if ((c >= 'a') && (c <= 'f')) return c - 'a' + 10;
+  if ((c >= 'A') && (c <= 'F')) return c - 'A' + 10;
+  return -1;
+}
+
+/* one or more decimal digits, to the end, that fit a uint64 */
+static int parse_digits(const char *s, const char *e, uint64_t *u) {
+  uint64_t d;
+  if (s == e) return -1;
+  for(*u=0; s < e; s++) {
+    if (!is_digit(*s)) return -1;
+    d = *s - '0';
+    if (*u > (UINT64_MAX - d) / 10) return -1;
+    *u = *u*10 + d;
+  }
+  return 0;
+}
+
+/* decimal integer with optional sign, in [lo,hi] */
+int cast_parse_int(const char *s, int len, int64_t lo, int64_t hi, int64_t *v) {
+  const char *e = s + len;
+  uint64_t u;
+  int neg = 0;
+
+  if ((s < e) && ((*s == '-') || (*s == '+'))) neg = (*s++ == '-');
+  if (parse_digits(s, e, &u) < 0) return -1;
+  if (u > (uint64_t)INT64_MAX + neg) return -1;
+  *v = neg ? (int64_t)(0 - u) : (int64_t)u;
+  return ((*v < lo) || (*v > hi)) ? -1 : 0;
+}
+
+int cast_parse_u64(const char *s, int len, uint64_t *v) {
+  const char *e = s + len;
+  if ((s < e) && (*s == '+')) s++;
+  return parse_digits(s, e, v);
+}
+
+/* epoch nanoseconds; or epoch seconds with a decimal point and up to
+ * nine places after it */
+int cast_parse_ts(const char *s, int len, int64_t *ns) {
+  const char *e = s + len, *dot;
+  uint64_t sec, frac = 0;
+  int neg = 0, places;
+
+  if (memchr(s, '.', len) == NULL) return cast_parse_int(s, len, INT64_MIN, INT64_MAX, ns);
+
+  if ((s < e) && ((*s == '-') || (*s == '+'))) neg = (*s++ == '-');
+  for(dot=s; (dot < e) && (*dot != '.'); dot++) ;
+  if (parse_digits(s, dot, &sec) < 0) return -1;
+  if (sec > INT64_MAX / 1000000000) return -1;
+  places = e - (dot+1);
+  if ((places > 9) || (parse_digits(dot+1, e, &frac) < 0)) return -1;
+  for(; places < 9; places++) frac *= 10;
+  if (sec * 1000000000 > INT64_MAX - frac) return -1;
+  *ns = sec * 1000000000 + frac;
+  if (neg) *ns = -*ns;
+  return 0;
+}
+
+/* true, false, 1 or 0 */
+int cast_parse_bool(const char *s, int len, uint8_t *b) {
+  if (((len == 1) && (*s == '1')) || ((len == 4) && !memcmp(s, "true", 4))) *b = 1;
+  else if (((len == 1) && (*s == '0')) || ((len == 5) && !memcmp(s, "false", 5))) *b = 0;
+  else return -1;
+  return 0;
+}
+
+/* plain decimals of up to 19 significant digits and 22 decimal places, with
+ * a mantissa exact in a double, come out correctly rounded from one
+ * division by an exact power of ten. anything else (exponents, nan, inf,
+ * longer numbers) goes to strtod */
+#define D64_MAXLEN 400
+static const double d64_pow10[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8,
+  1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20,
+  1e21, 1e22 };
+
+int cast_parse_d64(const char *s, int len, double *d) {
+  const char *p = s, *e = s + len;
+  int neg = 0, nd = 0, sig = 0, places = 0, dot = 0;
+  char tmp[D64_MAXLEN+1], *end;
+  uint64_t m = 0;
+
+  if ((p < e) && ((*p == '-') || (*p == '+'))) neg = (*p++ == '-');
+  for(; p < e; p++) {
+    if ((*p == '.') && !dot) { dot = 1; continue; }
+    if (!is_digit(*p)) break;
+    nd++;
+    if (dot) places++;
+    if (m || (*p != '0')) sig++;
+    if (sig <= 19) m = m*10 + (*p - '0');
+  }
+  if ((p == e) && nd && (sig <= 19) && (m <= ((uint64_t)1 << 53)) &&
+      (places < sizeof(d64_pow10)/sizeof(*d64_pow10))) {
+    *d = (double)m / d64_pow10[places];
+    if (neg) *d = -*d;
+    return 0;
+  }
+
+  /* slow path */
+  if ((len == 0) || (len > D64_MAXLEN)) return -1;
+  memcpy(tmp, s, len);
+  tmp[len] = '\0';
+  *d = strtod(tmp, &end);
+  return (*end == '\0') ? 0 : -1;
+}
+
+/* dotted quad; each part 1-3 digits, at most 255 */
+int cast_parse_ipv4(const char *s, int len, uint8_t ip[4]) {
+  const char *e = s + len;
+  unsigned n, i, nd;
+
+  for(i=0; i < 4; i++) {
+    if ((i > 0) && ((s == e) || (*s++ != '.'))) return -1;
+    for(n=0, nd=0; (s < e) && is_digit(*s) && (nd < 3); s++, nd++) n = n*10 + (*s - '0');
+    if ((nd == 0) || (n > 255)) return -1;
+    ip[i] = n;
+  }
+  return (s == e) ? 0 : -1;
+}
+
+int cast_parse_ipv6(const char *s, int len, uint8_t ip[16]) {
+  char tmp[INET6_ADDRSTRLEN];
+  if (len >= sizeof(tmp)) return -1;
+  memcpy(tmp, s, len);
+  tmp[len] = '\0';
+  return (inet_pton(AF_INET6, tmp, ip) == 1) ? 0 : -1;
+}
+
+/* six colon-separated octets of 1-2 hex digits */
+int cast_parse_mac(const char *s, int len, uint8_t mac[6]) {
+  const char *e = s + len;
+  int i, h, n, nd;
+
+  for(i=0; i < 6; i++) {
+    if ((i > 0) && ((s == e) || (*s++ != ':'))) return -1;
+    for(n=0, nd=0; (s < e) && ((h = hex_val(*s)) >= 0) && (nd < 2); s++, nd++) n = n*16 + h;
+    if (nd == 0) return -1;
+    mac[i] = n;
+  }
+  return (s == e) ? 0 : -1;
+}
+
+/* digits of u, at p, returns the count */
+static int fmt_uint(char *p, uint64_t u) {
+  char rev[20];
+  int n = 0, i;
+  do { rev[n++] = '0' + (u % 10); u /= 10; } while (u);
+  for(i=0; i < n; i++) p[i] = rev[n-1-i];
+  return n;
+}
+
+int cast_fmt_int(char *buf, int64_t v) {
+  int n = 0;
+  if (v < 0) buf[n++] = '-';
+  n += fmt_uint(buf + n, (v < 0) ? -(uint64_t)v : (uint64_t)v);
+  buf[n] = '\0';
+  return n;
+}
+
+int cast_fmt_uint(char *buf, uint64_t v) {
+  int n = fmt_uint(buf, v);
+  buf[n] = '\0';
+  return n;
+}
+
+/* integer epoch nanoseconds */
+int cast_fmt_ts(char *buf, int64_t ns) {
+  return cast_fmt_int(buf, ns);
+}
+
+int cast_fmt_bool(char *buf, uint8_t b) {
+  strcpy(buf, b ? "true" : "false");
+  return b ? 4 : 5;
+}
+
+/* %f is the value rounded to six places, ties to even, from its exact
+ * binary value. below 2^32 the integer part fits a uint64 and, above 2^-11,
+ * the fraction is exactly f/2^63 for an integer f; then the six places are
+ * f*10^6/2^63, done in two 32-bit halves so as not to overflow. other
+ * values (and nan, inf) return -1 for the caller to printf */
+#define D64_HI 4294967296.0        /* 2^32 */
+#define D64_LO (1.0/2048)          /* 2^-11 */
+#define D64_SCALE 9223372036854775808.0 /* 2^63 */
+
+int cast_fmt_d64(char *buf, double d) {
+  uint64_t ip, f, a, b, c, q, r, half = (uint64_t)1 << 62;
+  double x = fabs(d), frac, sf;
+  int n = 0, i;
+
+  if (!(x < D64_HI)) return -1; /* also nan */
+  if ((x != 0) && (x < D64_LO)) return -1;
+  ip = (uint64_t)x;
+  frac = x - (double)ip;      /* exact */
+  sf = frac * D64_SCALE;      /* exact, a power of two */
+  f = (uint64_t)sf;
+  if ((double)f != sf) return -1;
+
+  a = (f >> 32) * 1000000;    /* < 2^51 */
+  b = (f & 0xffffffff) * 1000000; /* < 2^52 */
+  c = a + (b >> 32);
+  q = c >> 31;
+  r = ((c & 0x7fffffff) << 32) | (b & 0xffffffff);
+  if ((r > half) || ((r == half) && (q & 1))) q++;
+  if (q == 1000000) { q = 0; ip++; }
+
+  if (signbit(d)) buf[n++] = '-';
+  n += fmt_uint(buf + n, ip);
+  buf[n++] = '.';
+  for(i=5; i >= 0; i--) { buf[n+i] = '0' + (q % 10); q /= 10; }
+  n += 6;
+  buf[n] = '\0';
+  return n;
+}
+
+int cast_fmt_ipv4(char *buf, const uint8_t ip[4]) {
+  int n = 0, i;
+  for(i=0; i < 4; i++) {
+    if (i > 0) buf[n++] = '.';
+    n += fmt_uint(buf + n, ip[i]);
+  }
+  buf[n] = '\0';
+  return n;
+}
+
+int cast_fmt_ipv6(char *buf, const uint8_t ip[16]) {
+  if (inet_ntop(AF_INET6, ip, buf, CAST_FMTSZ) == NULL) return -1;
+  return strlen(buf);
+}
+
+int cast_fmt_mac(char *buf, const uint8_t mac[6]) {
+  static const char hex[] = "0123456789abcdef";
+  int n = 0, i;
+  for(i=0; i < 6; i++) {
+    if (i > 0) buf[n++] = ':';
+    buf[n++] = hex[mac[i] >> 4];
+    buf[n++] = hex[mac[i] & 0xf];
+  }
+  buf[n] = '\0';
+  return n;
+}
+
+/* varints are 7 bits a byte, low bits first, with the high bit set on
+ * every byte but the last. signed values are zigzagged first so small
+ * negatives stay short: 0,-1,1,-2.. go to 0,1,2,3.. */
+int cast_put_uvarint(uint8_t *p, uint64_t v) {
+  int n = 0;
+  while (v >= 0x80) {
+    p[n++] = (v & 0x7f) | 0x80;
+    v >>= 7;
+  }
+  p[n++] = v;
+  return n;
+}
+
+/* returns the bytes used, or -1 if truncated or overlong */
+int cast_get_uvarint(const uint8_t *p, size_t len, uint64_t *v) {
+  int n, shift;
+  for(*v=0, n=0, shift=0; (n < len) && (n < CAST_VARINTSZ); n++, shift += 7) {
+    *v |= (uint64_t)(p[n] & 0x7f) << shift;
+    if ((p[n] & 0x80) == 0) {
+      if ((n == CAST_VARINTSZ-1) && (p[n] > 1)) return -1; /* over 64 bits */
+      return n+1;
+    }
+  }
+  return -1;
+}
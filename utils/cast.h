@@ -0,0 +1,39 @@
+#ifndef _CAST_H_
+#define _CAST_H_
+#include <stddef.h>
+#include <stdint.h>
+
+/* parsers and formatters for the binary cast types. the parsers take the
+ * whole value (len bytes, not necessarily nul-terminated) and return 0, or
+ * -1 if it is not a valid value of the type. the formatters write into buf,
+ * which must have room for CAST_FMTSZ bytes, and return the length written
+ * (not counting the nul they add). outputs match the printf formats the
+ * casts have always used. ipv6 goes through inet_pton/inet_ntop */
+
+#define CAST_FMTSZ 64
+#define CAST_VARINTSZ 10 /* longest 64-bit varint */
+#define cast_zigzag(v)   (((uint64_t)(v) << 1) ^ (uint64_t)((int64_t)(v) >> 63))
+#define cast_unzigzag(u) ((int64_t)((u) >> 1) ^ -(int64_t)((u) & 1))
+
+int cast_parse_int(const char *s, int len, int64_t lo, int64_t hi, int64_t *v);
+int cast_parse_u64(const char *s, int len, uint64_t *v);
+int cast_parse_d64(const char *s, int len, double *d);
+int cast_parse_ts(const char *s, int len, int64_t *ns); /* ns, or secs.frac */
+int cast_parse_bool(const char *s, int len, uint8_t *b);
+int cast_parse_ipv4(const char *s, int len, uint8_t ip[4]); /* network order */
+int cast_parse_ipv6(const char *s, int len, uint8_t ip[16]);
+int cast_parse_mac(const char *s, int len, uint8_t mac[6]);
+
+int cast_fmt_int(char *buf, int64_t v);                 /* %d */
+int cast_fmt_uint(char *buf, uint64_t v);               /* %u */
+int cast_fmt_ts(char *buf, int64_t ns);                 /* ns */
+int cast_fmt_bool(char *buf, uint8_t b);                /* true/false */
+int cast_fmt_d64(char *buf, double d);                  /* %f, or -1 */
+int cast_fmt_ipv4(char *buf, const uint8_t ip[4]);      /* a.b.c.d */
+int cast_fmt_ipv6(char *buf, const uint8_t ip[16]);     /* as inet_ntop */
+int cast_fmt_mac(char *buf, const uint8_t mac[6]);      /* %2.2x:... */
+
+int cast_put_uvarint(uint8_t *p, uint64_t v);  /* needs CAST_VARINTSZ */
+int cast_get_uvarint(const uint8_t *p, size_t len, uint64_t *v);
+
+#endif /* _CAST_H_ */
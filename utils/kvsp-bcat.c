@@ -31,10 +31,9 @@ void usage(char *prog) {
 int main(int argc, char *argv[]) {
   void *sp=NULL;
   void *set=NULL;
-  int opt,rc=-1;
+  int opt,rc=-1,sc;
   char *config_file, *b;
   size_t l;
-  set = kv_set_new();
   utarray_new(output_keys, &ut_str_icd);
   utarray_new(output_defaults, &ut_str_icd);
   utarray_new(output_types,&ut_int_icd);
@@ -52,12 +51,18 @@ int main(int argc, char *argv[]) {
   }
   if (spool == NULL) usage(argv[0]);
   if (parse_config(config_file) < 0) goto done;
+  set = kv_set_new_schema(output_schema);
 
   sp = kv_spoolreader_new(spool);
   if (!sp) goto done;
+  /* only the cast keys are needed; skip the rest when decoding */
+  if (kv_spoolreader_project(sp, (const char**)utarray_front(output_keys),
+                             utarray_len(output_keys)) < 0) goto done;
 
-  while (kv_spool_read(sp,set,1) > 0) {
-    if (set_to_binary(set,tmp) < 0) goto done;
+  while (kv_spool_read_view(sp,set) > 0) {
+    sc = set_to_binary(set,tmp);
+    if (sc < 0) goto done;
+    if (sc > 0) continue; /* bad value; skipped */
 
     b = utstring_body(tmp);
     l = utstring_len(tmp);
@@ -72,7 +77,7 @@ int main(int argc, char *argv[]) {
 
  done:
   if (sp) kv_spoolreader_free(sp);
-  kv_set_free(set);
+  if (set) kv_set_free(set);
   utarray_free(output_keys);
   utarray_free(output_defaults);
   utarray_free(output_types);
@@ -6,15 +6,254 @@
 #include "utarray.h"
 #include "utstring.h"
 #include "kvsp-bconfig.h"
+#include "cast.h"
 
 UT_array /* of string */ *output_keys;
 UT_array /* of string */ *output_defaults;
 UT_array /* of int */    *output_types;
 
-#define x(t) #t,
+#define x(t,s) #s,
 char *supported_types_str[] = { TYPES };
 #undef x
 
+/*******************************************************************************
+ * cast plan
+ *
+ * parse_config compiles the cast into a flat array, one entry per output
+ * field, holding what set_to_binary would otherwise work out per frame: the
+ * prepared key lookup, the slot of the key in output_schema (the distinct
+ * output keys), the default as a pair, and the encoded width. summing the
+ * widths, plus the lengths of the string values, gives the size of the
+ * encoding up front; set_to_binary sizes the output once and then writes
+ * each field straight into it.
+ ******************************************************************************/
+/*******************************************************************************
+ * dict fields
+ *
+ * a dict field sends a string as a small code once it has been seen. each
+ * dict field of the cast has its own dictionary, built up by the sender as
+ * it goes and mirrored by the receiver from the stream itself. the field is
+ * a uvarint tag, then:
+ *
+ *   0      literal: uvarint length, string (sent when the dictionary is full)
+ *   2c+1   define code c as: uvarint length, string 
+ *   2c+2   the string of code c
+ *
+ * codes are assigned in order from 0, so a define is always for the next
+ * code. the dictionaries only make sense to a receiver that has seen the
+ * stream from its start, or has been sent a snapshot of them (dict_snapshot)
+ * where it joined; a sender calls dict_reset whenever it starts a new
+ * stream, and so does the receiver. a receiver ignores the define of a code
+ * it already has from a snapshot.
+ *
+ * control frames carry a length with CTL_FRAME set, then a type byte. a
+ * CTL_DICT frame holds part of one dictionary: uvarint field index (in the
+ * cast), uvarint first code, uvarint count, then count strings each as
+ * uvarint length, string. a CTL_HELLO frame is a session id and a frame
+ * sequence number, both uint64, and a flags byte (see hello_frame).
+ ******************************************************************************/
+#define DICT_MAX 65536  /* codes per dict field */
+
+typedef struct {
+  char *s;
+  int len;
+  uint32_t code;
+  UT_hash_handle hh;
+} dict_ent_t;
+
+typedef struct {
+  dict_ent_t *index; /* strings to codes; sender only */
+  dict_ent_t **ent;  /* entries by code */
+  uint32_t n;        /* codes in use */
+  uint32_t alloc;    /* allocated length of ent */
+} dict_t;
+
+typedef struct {
+  int type;
+  char *key;
+  kv_key_t kkey;    /* for sets not bound to output_schema */
+  int slot;         /* for sets bound to output_schema */
+  kv_t dflt;        /* used if the key is absent */
+  int has_dflt;
+  dict_t *dict;     /* for a dict field */
+  int added;        /* dict code defined by the frame being encoded */
+  size_t width;     /* encoded size (an upper bound for ipv46, varints); for
+                     * strings, the size of the length prefix */
+} cast_t;
+
+void *output_schema;
+static cast_t *plan;
+static kv_t **plan_kv; /* the pair to encode for each field */
+static int nplan;
+static size_t plan_width; /* total of the widths */
+
+static size_t type_width(int t) {
+  switch(t) {
+    case i8:    return sizeof(uint8_t);
+    case i16:   return sizeof(uint16_t);
+    case i32:   return sizeof(uint32_t);
+    case d64:   return sizeof(double);
+    case ipv4:  return sizeof(uint32_t);
+    case ipv46: return sizeof(uint8_t) + sizeof(struct in6_addr);
+    case mac:   return 6;
+    case str8:  return sizeof(uint8_t);
+    case str:   return sizeof(uint32_t);
+    case i64:   return sizeof(int64_t);
+    case u64:   return sizeof(uint64_t);
+    case ts:    return sizeof(int64_t);
+    case boolean: return sizeof(uint8_t);
+    case varint: return CAST_VARINTSZ;
+    case uvarint: return CAST_VARINTSZ;
+    case dict:  return 2*CAST_VARINTSZ; /* tag, length */
+  }
+  assert(0);
+  return 0;
+}
+
+static int compile_plan(void) {
+  int i, j, n=0, len = utarray_len(output_keys);
+  const char **distinct;
+  char **k, **def;
+  cast_t *c;
+
+  plan = calloc(len+1, sizeof(cast_t));
+  plan_kv = calloc(len+1, sizeof(kv_t*));
+  distinct = calloc(len+1, sizeof(char*));
+  if (!plan || !plan_kv || !distinct) {
+    fprintf(stderr,"out of memory\n");
+    return -1;
+  }
+  for(i=0; i < len; i++) {
+    k = (char**)utarray_eltptr(output_keys,i);
+    for(j=0; j < n; j++) if (!strcmp(distinct[j],*k)) break;
+    if (j == n) distinct[n++] = *k;
+  }
+  output_schema = kv_schema_new(distinct, n);
+  free(distinct);
+  if (output_schema == NULL) return -1;
+
+  for(i=0; i < len; i++) {
+    c = &plan[i];
+    k = (char**)utarray_eltptr(output_keys,i);
+    def = (char**)utarray_eltptr(output_defaults,i);
+    c->type = *(int*)utarray_eltptr(output_types,i);
+    c->key = *k;
+    kv_key_init(&c->kkey,*k);
+    c->slot = kv_schema_slot(output_schema,*k);
+    if (*def) { /* default */
+      c->dflt.val = *def;
+      c->dflt.vlen = strlen(*def);
+      c->has_dflt = 1;
+    } else if (c->type == str) { /* zero len string */
+      c->dflt.val = "";
+      c->dflt.vlen = 0;
+      c->has_dflt = 1;
+    }
+    if ((c->type == dict) && ((c->dict = calloc(1, sizeof(dict_t))) == NULL)) {
+      fprintf(stderr,"out of memory\n");
+      return -1;
+    }
+    c->width = type_width(c->type);
+    plan_width += c->width;
+  }
+  nplan = len;
+  return 0;
+}
+
+/* give the string the next code; returns the entry */
+static dict_ent_t *dict_add(dict_t *d, const char *str, int len) {
+  dict_ent_t **ent, *e;
+
+  if (d->n == d->alloc) {
+    d->alloc = d->alloc ? 2*d->alloc : 64;
+    if ( (ent = realloc(d->ent, d->alloc * sizeof(*ent))) == NULL) goto oom;
+    d->ent = ent;
+  }
+  if ( (e = calloc(1, sizeof(*e))) == NULL) goto oom;
+  if ( (e->s = malloc(len+1)) == NULL) { free(e); goto oom; }
+  memcpy(e->s, str, len);
+  e->s[len] = '\0';
+  e->len = len;
+  e->code = d->n;
+  d->ent[d->n++] = e;
+  return e;
+
+ oom:
+  fprintf(stderr,"out of memory\n");
+  return NULL;
+}
+
+/* take back the last code given, if sending its frame failed */
+static void dict_undo(dict_t *d) {
+  dict_ent_t *e = d->ent[--d->n];
+  if (d->index) HASH_DEL(d->index, e);
+  free(e->s);
+  free(e);
+}
+
+void dict_reset(void) {
+  int i;
+  for(i=0; i < nplan; i++) {
+    if (plan[i].dict == NULL) continue;
+    while (plan[i].dict->n) dict_undo(plan[i].dict);
+  }
+}
+
+static void put_uvarint(UT_string *s, uint64_t v) {
+  uint8_t b[CAST_VARINTSZ];
+  utstring_bincpy(s, b, cast_put_uvarint(b, v));
+}
+
+/* append the dictionaries as control frames; none if they are empty */
+#define CTL_CHUNK (64*1024) /* about this much string data per frame */
+void dict_snapshot(UT_string *out) {
+  uint32_t c, e, hdr;
+  size_t start, sz;
+  uint8_t type = CTL_DICT;
+  dict_t *d;
+  int i;
+
+  for(i=0; i < nplan; i++) {
+    if ((d = plan[i].dict) == NULL) continue;
+    for(c=0; c < d->n; c = e) {
+      for(e=c, sz=0; (e < d->n) && ((e == c) || (sz < CTL_CHUNK)); e++) sz += d->ent[e]->len;
+      start = utstring_len(out);
+      hdr = 0;
+      utstring_bincpy(out, &hdr, sizeof(hdr)); /* placeholder */
+      utstring_bincpy(out, &type, sizeof(type));
+      put_uvarint(out, i);
+      put_uvarint(out, c);
+      put_uvarint(out, e - c);
+      for(; c < e; c++) {
+        put_uvarint(out, d->ent[c]->len);
+        utstring_bincpy(out, d->ent[c]->s, d->ent[c]->len);
+      }
+      hdr = (utstring_len(out) - start - sizeof(hdr)) | CTL_FRAME;
+      memcpy(utstring_body(out) + start, &hdr, sizeof(hdr));
+    }
+  }
+}
+
+/* encode the dict field at p; returns the new p, or NULL */
+static char *dict_encode(cast_t *cp, kv_t *kv, char *p) {
+  dict_t *d = cp->dict;
+  dict_ent_t *e;
+
+  HASH_FIND(hh, d->index, kv->val, kv->vlen, e);
+  if (e) return p + cast_put_uvarint((uint8_t*)p, 2*(uint64_t)e->code + 2);
+
+  if (d->n < DICT_MAX) {
+    if ( (e = dict_add(d, kv->val, kv->vlen)) == NULL) return NULL;
+    HASH_ADD_KEYPTR(hh, d->index, e->s, e->len, e);
+    cp->added = 1;
+    p += cast_put_uvarint((uint8_t*)p, 2*(uint64_t)e->code + 1);
+  } else p += cast_put_uvarint((uint8_t*)p, 0);
+
+  p += cast_put_uvarint((uint8_t*)p, kv->vlen);
+  memcpy(p, kv->val, kv->vlen);
+  return p + kv->vlen;
+}
+
 int parse_config(char *config_file) {
   char line[100];
   FILE *file;
@@ -33,7 +272,8 @@ int parse_config(char *config_file) {
     }
     nl = strchr(line,'\n'); if (nl) *nl='\0';
     for(t=0; t<adim(supported_types_str); t++) {
-      if(!strncmp(supported_types_str[t],line,sp-line)) break;
+      if ((strlen(supported_types_str[t]) == sp-line) &&
+          !strncmp(supported_types_str[t],line,sp-line)) break;
     }
     if (t >= adim(supported_types_str)){
       fprintf(stderr,"unknown type %s\n",line); 
@@ -47,101 +287,171 @@ int parse_config(char *config_file) {
     utarray_push_back(output_keys,&id);
     utarray_push_back(output_defaults,&def);
   }
+  if (compile_plan() < 0) goto done;
   rc = 0;
  done:
   if (file) fclose(file);
   return rc;
 }
 
-int set_to_binary(void *set, UT_string *bin) {
-  uint32_t l, u, a,b,c,d,e,f, abcd;
-  struct in_addr ia4;
-  struct in6_addr ia6;
-  uint16_t s;
-  uint8_t g;
-  double h;
-  utstring_clear(bin);
-  l=0; utstring_bincpy(bin,&l,sizeof(l)); // placeholder for size prefix
-  int rc=-1,i=0,*t;
-  kv_t *kv, kvdef;
-  char **k=NULL,**def;
-  while( (k=(char**)utarray_next(output_keys,k))) {
-    kv = kv_get(set,*k);
-    t = (int*)utarray_eltptr(output_types,i); assert(t);
-    def = (char**)utarray_eltptr(output_defaults,i); assert(def);
+/* a frame that fails to encode is not sent, so neither are its defines */
+static void undo_dicts(void) {
+  int i;
+  for(i=0; i < nplan; i++) {
+    if (plan[i].added) dict_undo(plan[i].dict);
+    plan[i].added = 0;
+  }
+}
+
+/* look up the fields of the set, and return the most its encoding can
+ * take, or 0 if it lacks a key. set_binary_encode then encodes it. the
+ * two let a caller encode straight into its own buffer */
+size_t set_binary_size(void *set) {
+  size_t sz;
+  int i;
+  kv_t *kv;
+  cast_t *cp;
+  int slotted = (kv_set_schema(set) == output_schema);
+
+  sz = sizeof(uint32_t) + plan_width; /* size prefix, fields */
+  for(i=0; i < nplan; i++) {
+    cp = &plan[i];
+    kv = slotted ? kv_get_slot(set,cp->slot) : kv_getk(set,&cp->kkey);
     if (kv==NULL) { /* no such key */
-      kv=&kvdef;
-      if (*def) {kv->val=*def; kv->vlen=strlen(*def);} /* default */
-      else if (*t == str) {kv->val=NULL; kv->vlen=0;}  /* zero len string */
-      else {
-        fprintf(stderr,"required key %s not present in spool frame\n", *k);
-        goto done;
+      if (!cp->has_dflt) {
+        fprintf(stderr,"required key %s not present in spool frame\n", cp->key);
+        return 0;
       }
+      kv = &cp->dflt;
     }
-    switch(*t) {
-      case d64: h=atof(kv->val); utstring_bincpy(bin,&h,sizeof(h)); break;
-      case i8:  g=atoi(kv->val); utstring_bincpy(bin,&g,sizeof(g)); break;
-      case i16: s=atoi(kv->val); utstring_bincpy(bin,&s,sizeof(s)); break;
-      case i32: u=atoi(kv->val); utstring_bincpy(bin,&u,sizeof(u)); break;
+    if ((cp->type == str) || (cp->type == str8) || (cp->type == dict)) sz += kv->vlen;
+    plan_kv[i] = kv;
+    cp->added = 0;
+  }
+  return sz;
+}
+
+/* encode the set last sized into o, which has room for that size, and
+ * set *len to the length used. returns 1 if a value doesn't parse as its
+ * cast type; the frame is then to be skipped */
+int set_binary_encode(char *o, size_t *len) {
+  uint32_t l, u;
+  uint64_t v;
+  int64_t n;
+  uint16_t s;
+  uint8_t g;
+  double h;
+  int rc=-1,i;
+  char *p;
+  kv_t *kv;
+  cast_t *cp;
+
+  p = o + sizeof(l); /* size prefix goes in last */
+
+  for(i=0; i < nplan; i++) {
+    cp = &plan[i];
+    kv = plan_kv[i];
+    switch(cp->type) {
+      case d64:
+        if (cast_parse_d64(kv->val,kv->vlen,&h) < 0) goto invalid;
+        memcpy(p,&h,sizeof(h)); p+=sizeof(h);
+        break;
+      case i8:
+        if (cast_parse_int(kv->val,kv->vlen,INT8_MIN,UINT8_MAX,&n) < 0) goto invalid;
+        g=n; memcpy(p,&g,sizeof(g)); p+=sizeof(g);
+        break;
+      case i16:
+        if (cast_parse_int(kv->val,kv->vlen,INT16_MIN,UINT16_MAX,&n) < 0) goto invalid;
+        s=n; memcpy(p,&s,sizeof(s)); p+=sizeof(s);
+        break;
+      case i32:
+        if (cast_parse_int(kv->val,kv->vlen,INT32_MIN,UINT32_MAX,&n) < 0) goto invalid;
+        u=n; memcpy(p,&u,sizeof(u)); p+=sizeof(u);
+        break;
+      case i64:
+        if (cast_parse_int(kv->val,kv->vlen,INT64_MIN,INT64_MAX,&n) < 0) goto invalid;
+        memcpy(p,&n,sizeof(n)); p+=sizeof(n);
+        break;
+      case u64:
+        if (cast_parse_u64(kv->val,kv->vlen,&v) < 0) goto invalid;
+        memcpy(p,&v,sizeof(v)); p+=sizeof(v);
+        break;
+      case ts:
+        if (cast_parse_ts(kv->val,kv->vlen,&n) < 0) goto invalid;
+        memcpy(p,&n,sizeof(n)); p+=sizeof(n);
+        break;
+      case boolean:
+        if (cast_parse_bool(kv->val,kv->vlen,(uint8_t*)p) < 0) goto invalid;
+        p+=sizeof(uint8_t);
+        break;
+      case varint:
+        if (cast_parse_int(kv->val,kv->vlen,INT64_MIN,INT64_MAX,&n) < 0) goto invalid;
+        p += cast_put_uvarint((uint8_t*)p,cast_zigzag(n));
+        break;
+      case uvarint:
+        if (cast_parse_u64(kv->val,kv->vlen,&v) < 0) goto invalid;
+        p += cast_put_uvarint((uint8_t*)p,v);
+        break;
+      case dict:
+        if ( (p = dict_encode(cp,kv,p)) == NULL) goto done;
+        break;
       case str8: 
-        g=kv->vlen; utstring_bincpy(bin,&g,sizeof(g)); /* length prefix */
-        utstring_bincpy(bin,kv->val,g);                /* string itself */
+        g=kv->vlen; memcpy(p,&g,sizeof(g)); p+=sizeof(g); /* length prefix */
+        memcpy(p,kv->val,g); p+=g;                        /* string itself */
         break;
       case str: 
-        l=kv->vlen; utstring_bincpy(bin,&l,sizeof(l)); /* length prefix */
-        utstring_bincpy(bin,kv->val,kv->vlen);         /* string itself */
+        l=kv->vlen; memcpy(p,&l,sizeof(l)); p+=sizeof(l); /* length prefix */
+        memcpy(p,kv->val,l); p+=l;                        /* string itself */
         break;
       case mac: 
-        if ((sscanf(kv->val,"%x:%x:%x:%x:%x:%x",&a,&b,&c,&d,&e,&f) != 6) ||
-           (a > 255 || b > 255 || c > 255 || d > 255 || e > 255 || f > 255)) {
-          fprintf(stderr,"invalid MAC for key %s: %s\n",*k,kv->val);
-          goto done;
-        }
-        g=a; utstring_bincpy(bin,&g,sizeof(g));
-        g=b; utstring_bincpy(bin,&g,sizeof(g));
-        g=c; utstring_bincpy(bin,&g,sizeof(g));
-        g=d; utstring_bincpy(bin,&g,sizeof(g));
-        g=e; utstring_bincpy(bin,&g,sizeof(g));
-        g=f; utstring_bincpy(bin,&g,sizeof(g));
+        if (cast_parse_mac(kv->val,kv->vlen,(uint8_t*)p) < 0) goto invalid;
+        p += 6;
         break;
       case ipv46: 
-        memset(&ia4, 0, sizeof(ia4));
-        memset(&ia6, 0, sizeof(ia6));
-        if (inet_pton(AF_INET, kv->val, &ia4) == 1) {
-          assert( 4 == sizeof(struct in_addr));
-          g=4; utstring_bincpy(bin,&g,sizeof(g));
-          utstring_bincpy(bin, &ia4, sizeof(struct in_addr));
-        } else if (inet_pton(AF_INET6, kv->val, &ia6) == 1) {
-          assert( 16 == sizeof(struct in6_addr));
-          g=16; utstring_bincpy(bin,&g,sizeof(g));
-          utstring_bincpy(bin, &ia6, sizeof(struct in6_addr));
-        } else {
-          fprintf(stderr,"invalid IP for key %s: %s\n",*k,kv->val);
-          goto done;
-        }
+        if (cast_parse_ipv4(kv->val,kv->vlen,(uint8_t*)p+1) == 0) {
+          *p = 4; p += 1+4;
+        } else if (cast_parse_ipv6(kv->val,kv->vlen,(uint8_t*)p+1) == 0) {
+          *p = 16; p += 1+16;
+        } else goto invalid;
         break;
       case ipv4: 
-        if ((sscanf(kv->val,"%u.%u.%u.%u",&a,&b,&c,&d) != 4) ||
-           (a > 255 || b > 255 || c > 255 || d > 255)) {
-          fprintf(stderr,"invalid IP for key %s: %s\n",*k,kv->val);
-          goto done;
-        }
-        abcd = (a << 24) | (b << 16) | (c << 8) | d;
-        abcd = htonl(abcd);
-        utstring_bincpy(bin,&abcd,sizeof(abcd));
+        if (cast_parse_ipv4(kv->val,kv->vlen,(uint8_t*)p) < 0) goto invalid;
+        p += 4; /* network order */
         break;
       default: assert(0); break;
     }
-    i++;
   }
-  uint32_t len = utstring_len(bin); len -= sizeof(len); // length does not include itself
-  char *length_prefix = utstring_body(bin);
-  memcpy(length_prefix, &len, sizeof(len));
+  *len = p - o;
+  l = *len - sizeof(l); // length does not include itself
+  memcpy(o, &l, sizeof(l));
 
   rc = 0;
 
  done:
+  if (rc < 0) undo_dicts();
   return rc;
+
+ invalid:
+  fprintf(stderr,"invalid %s for key %s: %s; skipping frame\n",
+          supported_types_str[cp->type], cp->key, kv->val);
+  undo_dicts();
+  return 1;
+}
+
+/* returns 1, leaving bin empty, for a frame to skip */
+int set_to_binary(void *set, UT_string *bin) {
+  size_t sz, len;
+  int rc;
+
+  utstring_clear(bin);
+  if ( (sz = set_binary_size(set)) == 0) return -1;
+  utstring_reserve(bin,sz+1); /* and a nul, as utstring keeps */
+  rc = set_binary_encode(utstring_body(bin), &len);
+  if (rc) return rc;
+  assert(len <= sz);
+  bin->i = len;
+  utstring_body(bin)[len] = '\0';
+  return 0;
 }
 
 static int get(void **msg_data,size_t *msg_len,void *dst,size_t len) {
@@ -155,14 +465,123 @@ static int get(void **msg_data,size_t *msg_len,void *dst,size_t len) {
   return 0;
 }
 
-int binary_to_frame(void *sp, void *set, void *msg_data, size_t msg_len, UT_string *tmp) {
-  int rc=-1,i=0,*t;
+static int get_uvarint(void **msg_data,size_t *msg_len,uint64_t *v) {
+  int n = cast_get_uvarint(*msg_data,*msg_len,v);
+  if (n < 0) {
+    fprintf(stderr,"received message with a bad varint\n"); 
+    return -1;
+  }
+  *(char**)msg_data += n;
+  *msg_len -= n;
+  return 0;
+}
+
+static int get_dict(void **msg_data,size_t *msg_len,dict_t *d,UT_string *tmp) {
+  uint64_t tag, len;
+  dict_ent_t *e;
+
+  if (get_uvarint(msg_data,msg_len,&tag) < 0) return -1;
+  if (tag && ((tag & 1) == 0)) { /* reference */
+    if ((tag-2)/2 >= d->n) {
+      fprintf(stderr,"received unknown dictionary code %lu\n",(unsigned long)(tag-2)/2);
+      return -1;
+    }
+    e = d->ent[(tag-2)/2];
+    utstring_bincpy(tmp,e->s,e->len);
+    return 0;
+  }
+
+  if (get_uvarint(msg_data,msg_len,&len) < 0) return -1;
+  if (len > *msg_len) {
+    fprintf(stderr,"received message shorter than expected\n"); 
+    return -1;
+  }
+  utstring_bincpy(tmp,*msg_data,len);
+  *(char**)msg_data += len;
+  *msg_len -= len;
+  if (tag == 0) return 0; /* literal */
+
+  if ((tag-1)/2 < d->n) return 0; /* known from a snapshot */
+  if ((tag-1)/2 > d->n) {
+    fprintf(stderr,"received dictionary code %lu out of order\n",(unsigned long)(tag-1)/2);
+    return -1;
+  }
+  if (dict_add(d,utstring_body(tmp),len) == NULL) return -1;
+  return 0;
+}
+
+/* a subscriber resuming a session sends the session id and the sequence
+ * number of the next frame it needs (0 and 0 to start afresh); the
+ * publisher answers with its session id and the sequence number of the
+ * frame it starts from. data frames are numbered from 0 in each session.
+ * the flags are the options the subscriber asks for (HELLO_ZLIB) and, in
+ * the answer, those the publisher agrees to. */
+void hello_frame(UT_string *out, uint64_t session, uint64_t seq, uint8_t flags) {
+  uint32_t hdr = (HELLO_LEN - sizeof(hdr)) | CTL_FRAME;
+  uint8_t type = CTL_HELLO;
+  utstring_bincpy(out, &hdr, sizeof(hdr));
+  utstring_bincpy(out, &type, sizeof(type));
+  utstring_bincpy(out, &session, sizeof(session));
+  utstring_bincpy(out, &seq, sizeof(seq));
+  utstring_bincpy(out, &flags, sizeof(flags));
+}
+
+/* parse a hello control frame body */
+int hello_parse(void *msg_data, size_t msg_len, uint64_t *session, uint64_t *seq,
+                uint8_t *flags) {
+  uint8_t type;
+  if ((get(&msg_data,&msg_len,&type,sizeof(type)) < 0) || (type != CTL_HELLO) ||
+      (get(&msg_data,&msg_len,session,sizeof(*session)) < 0) ||
+      (get(&msg_data,&msg_len,seq,sizeof(*seq)) < 0) ||
+      (get(&msg_data,&msg_len,flags,sizeof(*flags)) < 0)) {
+    fprintf(stderr,"received malformed hello\n");
+    return -1;
+  }
+  return 0;
+}
+
+/* apply a control frame (its body, after the length) */
+int control_frame(void *msg_data, size_t msg_len) {
+  uint64_t field, code, count, len;
+  uint8_t type;
+  dict_t *d;
+
+  if (get(&msg_data,&msg_len,&type,sizeof(type)) < 0) return -1;
+  if (type != CTL_DICT) return 0; /* not for us */
+
+  if (get_uvarint(&msg_data,&msg_len,&field) < 0) return -1;
+  if (get_uvarint(&msg_data,&msg_len,&code) < 0) return -1;
+  if (get_uvarint(&msg_data,&msg_len,&count) < 0) return -1;
+  if ((field >= nplan) || ((d = plan[field].dict) == NULL)) {
+    fprintf(stderr,"received dictionary for non-dict field %lu\n",(unsigned long)field);
+    return -1;
+  }
+  for(; count; count--, code++) {
+    if (get_uvarint(&msg_data,&msg_len,&len) < 0) return -1;
+    if (len > msg_len) {
+      fprintf(stderr,"received message shorter than expected\n"); 
+      return -1;
+    }
+    if (code > d->n) {
+      fprintf(stderr,"received dictionary code %lu out of order\n",(unsigned long)code);
+      return -1;
+    }
+    if ((code == d->n) && (dict_add(d,msg_data,len) == NULL)) return -1;
+    msg_data = (char*)msg_data + len;
+    msg_len -= len;
+  }
+  return 0;
+}
+
+/* unpack a binary message into set */
+int binary_to_set(void *set, void *msg_data, size_t msg_len, UT_string *tmp) {
+  int rc=-1,i=0,n,*t;
   const char *key;
-  struct in_addr ia;
-  char dst[INET6_ADDRSTRLEN];
   char src[16];
 
-  uint32_t l, u, a,b,c,d, abcd;
+  uint32_t l, u;
+  uint64_t v;
+  int64_t q;
   uint16_t s;
   uint8_t g;
   double h;
@@ -175,10 +594,60 @@ int binary_to_frame(void *sp, void *set, void *msg_data, size_t msg_len, UT_stri
     // type is *t and key is *k
     utstring_clear(tmp);
     switch(*t) {
-      case d64: if (get(&msg_data,&msg_len,&h,sizeof(h))<0) goto done; utstring_printf(tmp,"%f",h); break;
-      case i8:  if (get(&msg_data,&msg_len,&g,sizeof(g))<0) goto done; utstring_printf(tmp,"%d",(int)g); break;
-      case i16: if (get(&msg_data,&msg_len,&s,sizeof(s))<0) goto done; utstring_printf(tmp,"%d",(int)s); break;
-      case i32: if (get(&msg_data,&msg_len,&u,sizeof(u))<0) goto done; utstring_printf(tmp,"%d",u); break;
+      case d64:
+        if (get(&msg_data,&msg_len,&h,sizeof(h))<0) goto done;
+        utstring_reserve(tmp,CAST_FMTSZ);
+        if ((n = cast_fmt_d64(utstring_body(tmp),h)) < 0) utstring_printf(tmp,"%f",h);
+        else tmp->i = n;
+        break;
+      case i8:
+        if (get(&msg_data,&msg_len,&g,sizeof(g))<0) goto done;
+        utstring_reserve(tmp,CAST_FMTSZ);
+        tmp->i = cast_fmt_int(utstring_body(tmp),g);
+        break;
+      case i16:
+        if (get(&msg_data,&msg_len,&s,sizeof(s))<0) goto done;
+        utstring_reserve(tmp,CAST_FMTSZ);
+        tmp->i = cast_fmt_int(utstring_body(tmp),s);
+        break;
+      case i32:
+        if (get(&msg_data,&msg_len,&u,sizeof(u))<0) goto done;
+        utstring_reserve(tmp,CAST_FMTSZ);
+        tmp->i = cast_fmt_int(utstring_body(tmp),(int32_t)u);
+        break;
+      case i64:
+        if (get(&msg_data,&msg_len,&q,sizeof(q))<0) goto done;
+        utstring_reserve(tmp,CAST_FMTSZ);
+        tmp->i = cast_fmt_int(utstring_body(tmp),q);
+        break;
+      case u64:
+        if (get(&msg_data,&msg_len,&v,sizeof(v))<0) goto done;
+        utstring_reserve(tmp,CAST_FMTSZ);
+        tmp->i = cast_fmt_uint(utstring_body(tmp),v);
+        break;
+      case ts:
+        if (get(&msg_data,&msg_len,&q,sizeof(q))<0) goto done;
+        utstring_reserve(tmp,CAST_FMTSZ);
+        tmp->i = cast_fmt_ts(utstring_body(tmp),q);
+        break;
+      case boolean:
+        if (get(&msg_data,&msg_len,&g,sizeof(g))<0) goto done;
+        utstring_reserve(tmp,CAST_FMTSZ);
+        tmp->i = cast_fmt_bool(utstring_body(tmp),g);
+        break;
+      case varint:
+        if (get_uvarint(&msg_data,&msg_len,&v) < 0) goto done;
+        utstring_reserve(tmp,CAST_FMTSZ);
+        tmp->i = cast_fmt_int(utstring_body(tmp),cast_unzigzag(v));
+        break;
+      case uvarint:
+        if (get_uvarint(&msg_data,&msg_len,&v) < 0) goto done;
+        utstring_reserve(tmp,CAST_FMTSZ);
+        tmp->i = cast_fmt_uint(utstring_body(tmp),v);
+        break;
+      case dict:
+        if (get_dict(&msg_data,&msg_len,plan[i].dict,tmp) < 0) goto done;
+        break;
       case str8:
         if (get(&msg_data,&msg_len,&g,sizeof(g)) < 0) goto done;
         utstring_reserve(tmp,g);
@@ -192,24 +661,26 @@ int binary_to_frame(void *sp, void *set, void *msg_data, size_t msg_len, UT_stri
         tmp->i += l;
         break;
       case ipv4:
-        if (get(&msg_data,&msg_len,&abcd,sizeof(abcd)) < 0) goto done;
-        ia.s_addr = abcd;
-        utstring_printf(tmp,"%s", inet_ntoa(ia));
+        if (get(&msg_data,&msg_len,src,4) < 0) goto done;
+        utstring_reserve(tmp,CAST_FMTSZ);
+        tmp->i = cast_fmt_ipv4(utstring_body(tmp),(uint8_t*)src);
         break;
       case ipv46:
         if (get(&msg_data,&msg_len,&g,sizeof(g)) < 0) goto done;
         assert((g == 4) || (g == 16));
         if (get(&msg_data,&msg_len,src,g) < 0) goto done;
-        if (inet_ntop((g == 4) ? AF_INET : AF_INET6, src, dst, sizeof(dst)) == NULL) {
+        utstring_reserve(tmp,CAST_FMTSZ);
+        if (g == 4) n = cast_fmt_ipv4(utstring_body(tmp),(uint8_t*)src);
+        else if ( (n = cast_fmt_ipv6(utstring_body(tmp),(uint8_t*)src)) < 0) {
           fprintf(stderr, "inet_ntop: %s\n", strerror(errno));
           goto done;
         }
-        utstring_printf(tmp,"%s", dst);
+        tmp->i = n;
         break;
       case mac:
         if (get(&msg_data,&msg_len,m,sizeof(m)) < 0) goto done;
-        utstring_printf(tmp,"%2.2x:%2.2x:%2.2x:%2.2x:%2.2x:%2.2x",
-           m[0], m[1], m[2], m[3], m[4], m[5]);
+        utstring_reserve(tmp,CAST_FMTSZ);
+        tmp->i = cast_fmt_mac(utstring_body(tmp),m);
         break;
       default: assert(0); break;
     }
@@ -217,7 +688,6 @@ int binary_to_frame(void *sp, void *set, void *msg_data, size_t msg_len, UT_stri
     key = *k;
     kv_add(set, key, strlen(key), utstring_body(tmp), utstring_len(tmp));
   }
-  kv_spool_write(sp, set);
 
   rc = 0;
 
@@ -225,3 +695,9 @@ int binary_to_frame(void *sp, void *set, void *msg_data, size_t msg_len, UT_stri
   if (rc) fprintf(stderr,"binary frame mismatches expected message length\n");
   return rc;
 }
+
+int binary_to_frame(void *sp, void *set, void *msg_data, size_t msg_len, UT_string *tmp) {
+  if (binary_to_set(set, msg_data, msg_len, tmp) < 0) return -1;
+  kv_spool_write(sp, set);
+  return 0;
+}
@@ -7,16 +7,42 @@
 extern UT_array /* of string */ *output_keys;
 extern UT_array /* of string */ *output_defaults;
 extern UT_array /* of int */    *output_types;
+extern void *output_schema; /* bind sets to this to cast from slots */
 
 int parse_config(char *);
 int set_to_binary(void *set, UT_string *bin);
+size_t set_binary_size(void *set);
+int set_binary_encode(char *o, size_t *len);
 int binary_to_frame(void *sp, void *set, void *msg_data, size_t msg_len, UT_string *tmp);
+int binary_to_set(void *set, void *msg_data, size_t msg_len, UT_string *tmp);
+void dict_reset(void); /* at the start of each stream */
+void dict_snapshot(UT_string *out); /* for a receiver joining mid-stream */
+int control_frame(void *msg_data, size_t msg_len);
+void hello_frame(UT_string *out, uint64_t session, uint64_t seq, uint8_t flags);
+int hello_parse(void *msg_data, size_t msg_len, uint64_t *session, uint64_t *seq,
+                uint8_t *flags);
+
+#define CTL_FRAME 0x80000000U /* length bit marking a control frame */
+#define CTL_DICT 1            /* control frame type: dictionary snapshot */
+#define CTL_HELLO 2           /* control frame type: session handshake */
+#define HELLO_LEN (sizeof(uint32_t) + 2*sizeof(uint8_t) + 2*sizeof(uint64_t))
+#define HELLO_ZLIB 0x1        /* hello flag: zlib blocks follow the hello */
+
+/* a zlib block is a uint32 compressed length, a uint32 raw length, then
+ * the compressed bytes. the raw bytes continue the stream of frames */
+#define ZBLOCK (64*1024)      /* raw bytes per block, at most */
+#define ZBLOCK_HDR (2*sizeof(uint32_t))
 
 
 extern char *supported_types_str[];
 
-#define TYPES x(i16) x(i32) x(ipv4) x(ipv46) x(str) x(str8) x(i8) x(d64) x(mac)
-#define x(t) t,
+/* new types go at the end, keeping the values of the existing ones.
+ * each is x(enum name, config name); bool is taken as a name in C */
+#define TYPES x(i16,i16) x(i32,i32) x(ipv4,ipv4) x(ipv46,ipv46) x(str,str)     \
+              x(str8,str8) x(i8,i8) x(d64,d64) x(mac,mac) x(i64,i64)           \
+              x(u64,u64) x(ts,ts) x(boolean,bool) x(varint,varint)             \
+              x(uvarint,uvarint) x(dict,dict)
+#define x(t,s) t,
 enum supported_types { TYPES };
 #undef x
 #define adim(a) (sizeof(a)/sizeof(*a))
@@ -45,7 +45,7 @@ void usage(char *prog) {
 int main(int argc, char *argv[]) {
   void *sp=NULL;
   void *set=NULL;
-  int opt,rc=-1;
+  int opt,rc=-1,sc;
   char *config_file, *bin;
   size_t len;
   set = kv_set_new();
@@ -78,7 +78,9 @@ int main(int argc, char *argv[]) {
 
   while (kv_spool_read(sp,set,1) > 0) { /* read til interrupted by signal */
 
-    if (set_to_binary(set,tmp) < 0) goto done;
+    sc = set_to_binary(set,tmp);
+    if (sc < 0) goto done;
+    if (sc > 0) continue; /* bad value; skipped */
     len = utstring_len(tmp);
     bin = utstring_body(tmp);
 
@@ -0,0 +1,225 @@
+#include <stdio.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include "cast.h"
+
+/*******************************************************************************
+ * binary cast conversion speed
+ *
+ * times the parse (text to binary) and format (binary to text) of each
+ * numeric and address cast type, through the libc calls the casts used to
+ * make and through the cast.c conversions, over the same values. it also
+ * checks that both come out the same.
+ ******************************************************************************/
+
+enum { t_i8, t_i16, t_i32, t_d64, t_ipv4, t_ipv46, t_mac, NTYPES };
+char *type_names[] = { "i8", "i16", "i32", "d64", "ipv4", "ipv46", "mac" };
+
+#define VALSZ 48
+int iterations=1000000;
+int verbose=0;
+char (*vals)[VALSZ];      /* text values */
+int *lens;
+uint8_t (*bins)[17];      /* binary values; ipv46 has a leading length */
+volatile unsigned sink;
+
+void usage(char *exe) {
+  fprintf(stderr,"usage: %s [-v] [-i iterations]\n", exe);
+  exit(-1);
+}
+
+void make_values(int t) {
+  int i, r;
+  for(i=0; i < iterations; i++) {
+    r = rand();
+    switch(t) {
+      case t_i8:  snprintf(vals[i],VALSZ,"%d",r % 256); break;
+      case t_i16: snprintf(vals[i],VALSZ,"%d",r % 65536); break;
+      case t_i32: snprintf(vals[i],VALSZ,"%d",r - RAND_MAX/2); break;
+      case t_d64: snprintf(vals[i],VALSZ,"%d.%d",r % 100000, rand() % 1000); break;
+      case t_ipv4:
+        snprintf(vals[i],VALSZ,"%d.%d.%d.%d",r & 0xff,(r>>8) & 0xff,(r>>16) & 0xff,rand() & 0xff);
+        break;
+      case t_ipv46:
+        if (r & 1) snprintf(vals[i],VALSZ,"10.%d.%d.%d",(r>>8) & 0xff,(r>>16) & 0xff,rand() & 0xff);
+        else snprintf(vals[i],VALSZ,"fe80::%x:%x",(r>>8) & 0xffff,rand() & 0xffff);
+        break;
+      case t_mac:
+        snprintf(vals[i],VALSZ,"00:1b:%2.2x:%2.2x:%2.2x:%2.2x",r & 0xff,(r>>8) & 0xff,
+                 (r>>16) & 0xff,rand() & 0xff);
+        break;
+    }
+    lens[i] = strlen(vals[i]);
+  }
+}
+
+/* the conversions as the casts used to do them */
+int libc_parse(int t, char *v, uint8_t *b) {
+  unsigned a,c,d,e,f,g;
+  double h;
+  int n;
+  switch(t) {
+    case t_i8:  b[0] = atoi(v); break;
+    case t_i16: n = atoi(v); memcpy(b,&n,2); break;
+    case t_i32: n = atoi(v); memcpy(b,&n,4); break;
+    case t_d64: h = atof(v); memcpy(b,&h,8); break;
+    case t_ipv4:
+      if (sscanf(v,"%u.%u.%u.%u",&a,&c,&d,&e) != 4) return -1;
+      b[0]=a; b[1]=c; b[2]=d; b[3]=e;
+      break;
+    case t_ipv46:
+      if (inet_pton(AF_INET, v, b+1) == 1) b[0] = 4;
+      else if (inet_pton(AF_INET6, v, b+1) == 1) b[0] = 16;
+      else return -1;
+      break;
+    case t_mac:
+      if (sscanf(v,"%x:%x:%x:%x:%x:%x",&a,&c,&d,&e,&f,&g) != 6) return -1;
+      b[0]=a; b[1]=c; b[2]=d; b[3]=e; b[4]=f; b[5]=g;
+      break;
+  }
+  return 0;
+}
+
+int cast_parse(int t, char *v, int len, uint8_t *b) {
+  int64_t n;
+  double h;
+  switch(t) {
+    case t_i8:  if (cast_parse_int(v,len,INT8_MIN,UINT8_MAX,&n) < 0) return -1; b[0]=n; break;
+    case t_i16: if (cast_parse_int(v,len,INT16_MIN,UINT16_MAX,&n) < 0) return -1; memcpy(b,&n,2); break;
+    case t_i32: if (cast_parse_int(v,len,INT32_MIN,UINT32_MAX,&n) < 0) return -1; memcpy(b,&n,4); break;
+    case t_d64: if (cast_parse_d64(v,len,&h) < 0) return -1; memcpy(b,&h,8); break;
+    case t_ipv4: return cast_parse_ipv4(v,len,b);
+    case t_ipv46:
+      if (cast_parse_ipv4(v,len,b+1) == 0) b[0] = 4;
+      else if (cast_parse_ipv6(v,len,b+1) == 0) b[0] = 16;
+      else return -1;
+      break;
+    case t_mac: return cast_parse_mac(v,len,b);
+  }
+  return 0;
+}
+
+int libc_fmt(int t, uint8_t *b, char *out) {
+  struct in_addr ia;
+  uint16_t s;
+  uint32_t u;
+  double h;
+  switch(t) {
+    case t_i8:  return snprintf(out,CAST_FMTSZ,"%d",(int)b[0]);
+    case t_i16: memcpy(&s,b,2); return snprintf(out,CAST_FMTSZ,"%d",(int)s);
+    case t_i32: memcpy(&u,b,4); return snprintf(out,CAST_FMTSZ,"%d",u);
+    case t_d64: memcpy(&h,b,8); return snprintf(out,CAST_FMTSZ,"%f",h);
+    case t_ipv4: memcpy(&ia,b,4); return snprintf(out,CAST_FMTSZ,"%s",inet_ntoa(ia));
+    case t_ipv46:
+      inet_ntop((b[0] == 4) ? AF_INET : AF_INET6, b+1, out, CAST_FMTSZ);
+      return strlen(out);
+    case t_mac:
+      return snprintf(out,CAST_FMTSZ,"%2.2x:%2.2x:%2.2x:%2.2x:%2.2x:%2.2x",
+                      b[0],b[1],b[2],b[3],b[4],b[5]);
+  }
+  return -1;
+}
+
+int cast_fmt(int t, uint8_t *b, char *out) {
+  uint16_t s;
+  uint32_t u;
+  double h;
+  int n;
+  switch(t) {
+    case t_i8:  return cast_fmt_int(out,b[0]);
+    case t_i16: memcpy(&s,b,2); return cast_fmt_int(out,s);
+    case t_i32: memcpy(&u,b,4); return cast_fmt_int(out,(int32_t)u);
+    case t_d64:
+      memcpy(&h,b,8);
+      if ( (n = cast_fmt_d64(out,h)) < 0) n = snprintf(out,CAST_FMTSZ,"%f",h);
+      return n;
+    case t_ipv4: return cast_fmt_ipv4(out,b);
+    case t_ipv46:
+      return (b[0] == 4) ? cast_fmt_ipv4(out,b+1) : cast_fmt_ipv6(out,b+1);
+    case t_mac: return cast_fmt_mac(out,b);
+  }
+  return -1;
+}
+
+long usec_since(struct timeval *t1) {
+  struct timeval t2;
+  gettimeofday(&t2,NULL);
+  return ((t2.tv_sec * 1000000) + t2.tv_usec) -
+         ((t1->tv_sec * 1000000) + t1->tv_usec);
+}
+
+void run(int t) {
+  long lp, cp, lf, cf;
+  struct timeval t1;
+  char out[CAST_FMTSZ], out2[CAST_FMTSZ];
+  uint8_t b[17], b2[17];
+  int i, bad=0;
+
+  make_values(t);
+
+  gettimeofday(&t1,NULL);
+  for(i=0; i < iterations; i++) { libc_parse(t,vals[i],b); sink += b[0]; }
+  lp = usec_since(&t1);
+
+  gettimeofday(&t1,NULL);
+  for(i=0; i < iterations; i++) { cast_parse(t,vals[i],lens[i],bins[i]); sink += bins[i][0]; }
+  cp = usec_since(&t1);
+
+  gettimeofday(&t1,NULL);
+  for(i=0; i < iterations; i++) sink += libc_fmt(t,bins[i],out);
+  lf = usec_since(&t1);
+
+  gettimeofday(&t1,NULL);
+  for(i=0; i < iterations; i++) sink += cast_fmt(t,bins[i],out);
+  cf = usec_since(&t1);
+
+  /* both ways agree */
+  for(i=0; i < iterations; i++) {
+    memset(b,0,sizeof(b)); memset(b2,0,sizeof(b2));
+    libc_parse(t,vals[i],b);
+    cast_parse(t,vals[i],lens[i],b2);
+    libc_fmt(t,b,out);
+    cast_fmt(t,b2,out2);
+    if (memcmp(b,b2,sizeof(b)) || strcmp(out,out2)) {
+      if (verbose) fprintf(stderr,"%s: %s: %s vs %s\n",type_names[t],vals[i],out,out2);
+      bad++;
+    }
+  }
+
+  printf("%-6s parse: %6ld kops libc, %6ld kops cast   "
+                "format: %6ld kops libc, %6ld kops cast%s\n", type_names[t],
+         iterations*1000L/(lp ? lp : 1), iterations*1000L/(cp ? cp : 1),
+         iterations*1000L/(lf ? lf : 1), iterations*1000L/(cf ? cf : 1),
+         bad ? "  MISMATCH" : "");
+}
+
+int main(int argc, char *argv[]) {
+  int opt, t;
+
+  while ( (opt = getopt(argc, argv, "i:v+")) != -1) {
+    switch (opt) {
+      case 'v': verbose++; break;
+      case 'i': iterations=atoi(optarg); break;
+      default: usage(argv[0]); break;
+    }
+  }
+  if (iterations <= 0) usage(argv[0]);
+
+  vals = malloc(iterations * sizeof(*vals));
+  lens = malloc(iterations * sizeof(*lens));
+  bins = calloc(iterations, sizeof(*bins));
+  if (!vals || !lens || !bins) {
+    fprintf(stderr,"out of memory\n");
+    return -1;
+  }
+
+  for(t=0; t < NTYPES; t++) run(t);
+
+  free(vals);
+  free(lens);
+  free(bins);
+  return 0;
+}
@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include "kvspool.h"
 #include "utarray.h"
@@ -44,13 +45,30 @@ int main(int argc, char *argv[]) {
   void *sp = kv_spoolreader_new(dir);
   if (!sp) exit(-1);
 
-  void *set = kv_set_new();
+  /* the keys to modify get fixed slots in the set. a key given twice
+   * is modified twice, but the schema takes it once */
+  UT_array *skeys;
+  utarray_new(skeys,&ut_str_icd);
+  char **k=NULL, **s;
+  while ( (k=(char**)utarray_next(keys,k))) {
+    s=NULL;
+    while ( (s=(char**)utarray_next(skeys,s))) if (!strcmp(*s,*k)) break;
+    if (!s) utarray_push_back(skeys,k);
+  }
+  void *schema = kv_schema_new((const char**)utarray_front(skeys), utarray_len(skeys));
+  if (!schema) exit(-1);
+  int *slot = calloc(utarray_len(keys), sizeof(int)), i=0;
+  if (!slot) exit(-1);
+  k=NULL;
+  while ( (k=(char**)utarray_next(keys,k))) slot[i++] = kv_schema_slot(schema,*k);
+  void *set = kv_set_new_schema(schema);
   while ( (rc=kv_spool_read(sp,set,1)) > 0) {
     /* calculate hash value of keys */
-    char *key, *val, **k=NULL;
+    char *key, *val;
+    k=NULL; i=0;
     while ( (k=(char**)utarray_next(keys,k))) {
       key = *k;
-      kv = kv_get(set, key);
+      kv = kv_get_slot(set, slot[i++]);
       if (!kv) {if (verbose) fprintf(stderr,"no such key: %s; skipping\n", key); continue;}
       /* replace the value with a hash of the value */
       unsigned hv=0, vlen=kv->vlen; val = kv->val;
@@ -68,6 +86,9 @@ int main(int argc, char *argv[]) {
   kv_spoolwriter_free(osp);
   kv_spoolreader_free(sp);
   kv_set_free(set);
+  kv_schema_free(schema);
+  free(slot);
+  utarray_free(skeys);
   utarray_free(keys);
   return 0;
 }
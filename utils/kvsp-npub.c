@@ -59,7 +59,7 @@ int read_lines(char *file, UT_array *lines) {
 }
 
 int main(int argc, char *argv[]) {
-  int opt,rc=-1;
+  int opt,rc=-1,sc;
   size_t len;
   void *buf;
   UT_array *endpoints;
@@ -100,7 +100,9 @@ int main(int argc, char *argv[]) {
   }
 
   while (kv_spool_read(sp,set,1) > 0) { /* read til interrupted by signal */
-    if (set_to_binary(set,tmp) < 0) goto done;
+    sc = set_to_binary(set,tmp);
+    if (sc < 0) goto done;
+    if (sc > 0) continue; /* bad value; skipped */
     buf = utstring_body(tmp);
     len = utstring_len(tmp);
     /* skip length preamble */
@@ -66,7 +66,7 @@ int main(int argc, char *argv[]) {
   if (!sp) goto done;
   o = json_object();
 
-  while (kv_spool_read(sp,set,1) > 0) { /* read til interrupted by signal */
+  while (kv_spool_read_view(sp,set) > 0) { /* read til interrupted by signal */
     zmq_msg_t part;
     json_object_clear(o);
     kv_t *kv = NULL;
@@ -9,24 +9,60 @@
 
 int frames=100000;
 int verbose=0;
+int threads=4;
 char *dir = "/dev/shm";
 char path[PATH_MAX];
 char *exe;
 
 void usage(char *exe) {
-  fprintf(stderr,"usage: %s [-v] [-i iterations] [<dir>]\n", exe);
+  fprintf(stderr,"usage: %s [-v] [-i iterations] [-t threads] [<dir>]\n", exe);
   exit(-1);
 }
 
-int individual_frames_test() {
-  long elapsed_usec_w, elapsed_usec_r;
+/* async writes are timed til flushed to the spool */
+long write_frames(void *set, int async) {
   struct timeval t1, t2;
   int i;
 
-  void *sp = kv_spoolwriter_new(dir);
+  void *sp = async ? kv_spoolwriter_new_async(dir, 1024, KV_ASYNC_BLOCK) :
+                     kv_spoolwriter_new(dir);
+  if (!sp) exit(-1);
+
+  gettimeofday(&t1,NULL);
+  for(i=0; i<frames; i++) kv_spool_write(sp,set);
+  if (async) kv_spool_flush(sp);
+  gettimeofday(&t2,NULL);
+
+  kv_spoolwriter_free(sp);
+  return ((t2.tv_sec * 1000000) + t2.tv_usec) - 
+         ((t1.tv_sec * 1000000) + t1.tv_usec);
+}
+
+long read_frames(void *set, int view) {
+  struct timeval t1, t2;
+  int i;
+
+  void *sp = kv_spoolreader_new_nb(dir, NULL);
   if (!sp) exit(-1);
 
-  char timebuf[100], iterbuf[10];
+  gettimeofday(&t1,NULL);
+  for(i=0; i<frames; i++) { 
+    if ((view ? kv_spool_read_view(sp,set) : kv_spool_read(sp,set,1)) < 1) {
+      fprintf(stderr, "spool too small to hold %d frames for test\n", frames);
+    }
+  }
+  gettimeofday(&t2,NULL);
+
+  kv_spoolreader_free(sp);
+  return ((t2.tv_sec * 1000000) + t2.tv_usec) - 
+         ((t1.tv_sec * 1000000) + t1.tv_usec);
+}
+
+int individual_frames_test() {
+  long elapsed_usec_w, elapsed_usec_r, elapsed_usec_a, elapsed_usec_v;
+  long elapsed_usec_q, elapsed_usec_s;
+
+  char timebuf[100], iterbuf[12];
   time_t t = time(NULL);
   snprintf(timebuf,sizeof(timebuf),"%s",ctime(&t));
   timebuf[strlen(timebuf)-1] = '\0'; /* trim \n */
@@ -38,45 +74,52 @@ int individual_frames_test() {
   kv_adds(set, "iter", iterbuf);
   printf("writing and reading individual frames:\n");
 
-  /* write test */
-  gettimeofday(&t1,NULL);
-  for(i=0; i<frames; i++) kv_spool_write(sp,set);
-  gettimeofday(&t2,NULL);
+  /* write test, then read test into a regular set */
+  elapsed_usec_w = write_frames(set, 0);
+  elapsed_usec_r = read_frames(set, 0);
 
-  elapsed_usec_w = ((t2.tv_sec * 1000000) + t2.tv_usec) - 
-                   ((t1.tv_sec * 1000000) + t1.tv_usec);
-  kv_spoolwriter_free(sp);
+  /* same again, reading into an arena-backed set */
+  void *aset = kv_set_new_arena(0);
+  write_frames(set, 0);
+  elapsed_usec_a = read_frames(aset, 0);
 
-  /* read test */
-  sp = kv_spoolreader_new_nb(dir, NULL);
-  gettimeofday(&t1,NULL);
-  for(i=0; i<frames; i++) { 
-    if (kv_spool_read(sp,set,1) < 1) {
-      fprintf(stderr, "spool too small to hold %d frames for test\n", frames);
-    }
-  }
-  gettimeofday(&t2,NULL);
+  /* and again, as zero-copy views of the frames */
+  write_frames(set, 0);
+  elapsed_usec_v = read_frames(aset, 1);
 
-  elapsed_usec_r = ((t2.tv_sec * 1000000) + t2.tv_usec) - 
-                   ((t1.tv_sec * 1000000) + t1.tv_usec);
+  /* and into a set whose schema has the keys */
+  const char *keys[] = {"from", "time", "iter"};
+  void *schema = kv_schema_new(keys, 3);
+  void *sset = kv_set_new_schema(schema);
+  write_frames(set, 0);
+  elapsed_usec_s = read_frames(sset, 1);
 
-  kv_spoolreader_free(sp);
+  /* write through the async writer thread */
+  elapsed_usec_q = write_frames(set, 1);
+  read_frames(aset, 1);
 
   printf("write: %d kfps\n", (int)(frames*1000/elapsed_usec_w));
+  printf("write: %d kfps (async)\n", (int)(frames*1000/elapsed_usec_q));
   printf("read:  %d kfps\n", (int)(frames*1000/elapsed_usec_r));
+  printf("read:  %d kfps (arena set)\n", (int)(frames*1000/elapsed_usec_a));
+  printf("read:  %d kfps (view)\n", (int)(frames*1000/elapsed_usec_v));
+  printf("read:  %d kfps (view, schema set)\n", (int)(frames*1000/elapsed_usec_s));
 
   kv_set_free(set);
+  kv_set_free(aset);
+  kv_set_free(sset);
+  kv_schema_free(schema);
 }
 
 int batch_frames_test() {
-  long elapsed_usec_w, elapsed_usec_r;
+  long elapsed_usec_w, elapsed_usec_r, elapsed_usec_t;
   struct timeval t1, t2;
   int sc, i, nset,total=0;
 
   void *sp = kv_spoolwriter_new(dir);
   if (!sp) exit(-1);
 
-  char timebuf[100], iterbuf[10];
+  char timebuf[100], iterbuf[12];
   time_t t = time(NULL);
   snprintf(timebuf,sizeof(timebuf),"%s",ctime(&t));
   timebuf[strlen(timebuf)-1] = '\0'; /* trim \n */
@@ -129,8 +172,43 @@ int batch_frames_test() {
 
   kv_spoolreader_free(sp);
 
+  /* read test, decoding on several threads */
+  sp = kv_spoolwriter_new(dir);
+  if (!sp) exit(-1);
+  for(i=0; i<frames; i++) {
+    kv_set_clear(setv[i]);
+    kv_adds(setv[i], "from", exe);
+    kv_adds(setv[i], "time", timebuf);
+    snprintf(iterbuf,sizeof(iterbuf),"%d",i);
+    kv_adds(setv[i], "iter", iterbuf);
+  }
+  kv_spool_writeN(sp,setv, frames);
+  kv_spoolwriter_free(sp);
+
+  sp = kv_spoolreader_new_nb(dir, NULL);
+  if (kv_spoolreader_threads(sp, threads) < 0) exit(-1);
+  total = 0;
+  gettimeofday(&t1,NULL);
+  do {
+    nset = frames;
+    sc = kv_spool_readN(sp,setv,&nset);
+    if (sc < 1) {
+        fprintf(stderr, "spool empty\n");
+        break;
+    }
+    total += nset;
+  } while (total < frames);
+
+  gettimeofday(&t2,NULL);
+
+  elapsed_usec_t = ((t2.tv_sec * 1000000) + t2.tv_usec) - 
+                   ((t1.tv_sec * 1000000) + t1.tv_usec);
+
+  kv_spoolreader_free(sp);
+
   printf("write: %d kfps\n", (int)(frames*1000/elapsed_usec_w));
   printf("read:  %d kfps\n", (int)(frames*1000/elapsed_usec_r));
+  printf("read:  %d kfps (%d threads)\n", (int)(frames*1000/elapsed_usec_t), threads);
 
 }
 
@@ -138,10 +216,11 @@ int main(int argc, char *argv[]) {
   int opt, sc, rc = -1;
 
   exe = argv[0];
-  while ( (opt = getopt(argc, argv, "i:v+")) != -1) {
+  while ( (opt = getopt(argc, argv, "i:t:v+")) != -1) {
     switch (opt) {
       case 'v': verbose++; break;
       case 'i': frames=atoi(optarg); break;
+      case 't': threads=atoi(optarg); break;
       default: usage(exe); break;
     }
   }
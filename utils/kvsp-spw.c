@@ -34,7 +34,7 @@ int main(int argc, char *argv[]) {
   void *sp = kv_spoolwriter_new(dir);
   if (!sp) exit(-1);
 
-  char timebuf[100], iterbuf[10];
+  char timebuf[100], iterbuf[12], i8buf[12], i16buf[12];
 
   while(iterations--) {
     time_t t = time(NULL);
@@ -42,6 +42,9 @@ int main(int argc, char *argv[]) {
     snprintf(timebuf,sizeof(timebuf),"%s",ctime(&t));
     timebuf[strlen(timebuf)-1] = '\0'; /* trim \n */
     snprintf(iterbuf,sizeof(iterbuf),"%d",iterations);
+    /* the narrow fields take the count modulo their range */
+    snprintf(i8buf,sizeof(i8buf),"%d",iterations % 128);
+    snprintf(i16buf,sizeof(i16buf),"%d",iterations % 32768);
 
     set = kv_set_new();
     kv_adds(set, "from", exe);
@@ -49,8 +52,8 @@ int main(int argc, char *argv[]) {
     kv_adds(set, "iter", iterbuf);
 
     /* put one of every kind of data */
-    kv_adds(set, "test_i8", iterbuf);
-    kv_adds(set, "test_i16", iterbuf);
+    kv_adds(set, "test_i8", i8buf);
+    kv_adds(set, "test_i16", i16buf);
     kv_adds(set, "test_i32", iterbuf);
     kv_adds(set, "test_ipv4", "192.168.1.1");
     kv_adds(set, "test1_ipv46", "fe80::20c:29ff:fe99:c21b");
@@ -59,7 +62,7 @@ int main(int argc, char *argv[]) {
     kv_adds(set, "test_str", "hello");
     kv_adds(set, "test_str8", "world!");
     kv_adds(set, "test_d64", "3.14159");
-    kv_adds(set, "test_mac", "00:11:22:33:44:55:66");
+    kv_adds(set, "test_mac", "00:11:22:33:44:55");
 
     kv_spool_write(sp,set);
     kv_set_free(set);
@@ -4,6 +4,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <stdint.h>
 #include <pcre.h>
 #include "kvspool_internal.h"
 #include "utarray.h"
@@ -33,51 +34,96 @@ void ospool_fin(void *_osp) {
 UT_icd ospool_icd = {sizeof(ospool_t),ospool_ini,ospool_cpy,ospool_fin};
 
 void usage(char *prog) {
-  fprintf(stderr, "usage: %s [-v] [-k key -r regex] -s spool <dstdir> ...\n", prog);
+  fprintf(stderr, "usage: %s [-v] [-k key -r regex] [-p key [-p key ...] | -R]"
+                  " -s spool <dstdir> ...\n", prog);
+  fprintf(stderr, "  -p partition: each frame goes to one dstdir, by hash of key(s)\n");
+  fprintf(stderr, "  -R partition: each frame goes to one dstdir, round-robin\n");
   exit(-1);
 }
 
-#define OVECSZ 30 /* must be multiple of 3 */
-int keep_record(void *set, char *key, pcre *re) {
-  int rc, ovec[OVECSZ];
-  if (!key) return 1;
-  if (!re) return 1;
+/*******************************************************************************
+ * partition mode
+ *
+ * each frame goes to one output, picked by a hash of the values of the
+ * partition keys, taken in the order given (a missing key hashes as an
+ * empty value). the hash is FNV-1a, so a given key always maps to the same
+ * output for a given number of outputs, across runs and hosts.
+ ******************************************************************************/
+#define FNV_OFFSET 2166136261U
+#define FNV_PRIME  16777619U
+
+static uint32_t fnv1a(uint32_t h, const char *p, int len) {
+  while (len--) { h ^= (unsigned char)*p++; h *= FNV_PRIME; }
+  return h;
+}
 
-  /* does set contain key */
-  kv_t *kv = kv_get(set, key);
-  if (kv == NULL) return 0; 
+/* pick the output for a frame image. vals holds a slot per partition key */
+int partition(char *img, size_t len, UT_array *pkeys, kv_t *vals, int n) {
+  int i, klen, vlen, np = utarray_len(pkeys);
+  char *key, *val, **k;
+  uint32_t h = FNV_OFFSET;
+  kv_frame_t f;
 
-  /* does value of key match regex */
-  rc = pcre_exec(re, NULL, kv->val, kv->vlen, 0, 0, ovec, OVECSZ);
+  for(i=0; i < np; i++) vals[i].vlen = 0;
+  if (kv_frame_open(&f, img, len, 0) < 0) return 0;
+  while (kv_frame_next(&f, &key, &klen, &val, &vlen) > 0) {
+    for(i=0; i < np; i++) {
+      k = (char**)utarray_eltptr(pkeys,i);
+      if ((vals[i].klen != klen) || memcmp(*k, key, klen)) continue;
+      vals[i].val = val;
+      vals[i].vlen = vlen;
+    }
+  }
+  for(i=0; i < np; i++) {
+    h = fnv1a(h, vals[i].val, vals[i].vlen);
+    h = fnv1a(h, "", 1); /* separator, so "ab","c" differs from "a","bc" */
+  }
+  return h % n;
+}
+
+/* does value of key match regex. the reader tests this on the frame 
+ * before decoding it, so frames without a match are never decoded */
+#define OVECSZ 30 /* must be multiple of 3 */
+int keep_record(const char *val, int vlen, void *re) {
+  int rc, ovec[OVECSZ];
+  rc = pcre_exec((pcre*)re, NULL, val, vlen, 0, 0, ovec, OVECSZ);
   return (rc > 0) ? 1 : 0;
 }
  
 int main(int argc, char * argv[]) {
   char *key=NULL, *regex=NULL;
-  pcre *re;
-  int opt,verbose=0,raw=0;
+  pcre *re=NULL;
+  void *filter;
+  int opt,verbose=0;
   ospool_t *osp;
-  void *set;
+  char *img;
+  size_t len;
+  UT_array *pkeys;  /* partition keys */
+  kv_t *vals=NULL;  /* their values in the current frame */
+  int rr=0, lo, hi, i, n=0;
+  uint64_t nf=0;    /* frames read, for round-robin */
   /* input spool */
   char *dir=NULL;
   void *sp;
 
-  set = kv_set_new();
   UT_array *ospoolv;
   utarray_new(ospoolv, &ospool_icd);
+  utarray_new(pkeys, &ut_str_icd);
  
-  while ( (opt = getopt(argc, argv, "v+s:k:r:W")) != -1) {
+  while ( (opt = getopt(argc, argv, "v+s:k:r:Wp:R")) != -1) {
     switch (opt) {
       case 'v': verbose++; break;
       case 's': dir = strdup(optarg); break;
       case 'k': key = strdup(optarg); break;
       case 'r': regex = strdup(optarg); break;
-      case 'W': raw = 1; break;
+      case 'W': break; /* raw mode is the only mode now */
+      case 'p': utarray_push_back(pkeys, &optarg); break;
+      case 'R': rr = 1; break;
       default: usage(argv[0]); break;
     }
   }
-  if (raw) fprintf(stderr, "-W (raw mode) is deprecated, using regular mode\n");
   if (dir==NULL) usage(argv[0]);
+  if (rr && utarray_len(pkeys)) usage(argv[0]);
   if (key && regex) {
       const char *err;
       int off; 
@@ -92,17 +138,30 @@ int main(int argc, char * argv[]) {
       fprintf(stderr, "failed to open input spool %s\n", dir);
       goto done;
   }
+  if (re) {
+    if ( (filter = kv_filter_fn(key, keep_record, re)) == NULL) goto done;
+    if (kv_spoolreader_filter(sp, filter) < 0) goto done;
+  }
 
   while (optind < argc) {
     utarray_extend_back(ospoolv);
     osp = (ospool_t*)utarray_back(ospoolv);
     osp->dir = strdup(argv[optind++]);
   }
+  n = utarray_len(ospoolv);
+  if (utarray_len(pkeys)) {
+    if ( (vals = calloc(utarray_len(pkeys), sizeof(kv_t))) == NULL) goto done;
+    for(i=0; i < utarray_len(pkeys); i++) 
+      vals[i].klen = strlen(*(char**)utarray_eltptr(pkeys,i));
+  }
 
-  while (kv_spool_read(sp,set,1) == 1) {
-    if (!keep_record(set,key,re)) continue;
-    osp=NULL;
-    while ( (osp=(ospool_t*)utarray_next(ospoolv,osp))) {
+  /* frames are passed through as is, without being decoded */
+  while (kv_spool_read_raw(sp,&img,&len) == 1) {
+    lo = 0; hi = n;  /* copy to all, unless partitioning */
+    if (n && vals) { lo = partition(img, len, pkeys, vals, n); hi = lo+1; }
+    else if (n && rr) { lo = nf++ % n; hi = lo+1; }
+    for(i=lo; i < hi; i++) {
+      osp = (ospool_t*)utarray_eltptr(ospoolv,i);
       if (osp->sp ==NULL) { /* do lazy open */
         osp->sp = kv_spoolwriter_new(osp->dir);
         if (!osp->sp) {
@@ -110,18 +169,19 @@ int main(int argc, char * argv[]) {
           goto done;
         }
       }
-     kv_spool_write(osp->sp,set);
+     kv_spool_write_raw(osp->sp,img,len);
     }
   }
 
  done:
-  kv_set_free(set);
   osp=NULL;
   /* free the spoolwriter handles */
   while ( (osp=(ospool_t*)utarray_next(ospoolv,osp))) {
-    kv_spoolwriter_free(osp->sp);
+    if (osp->sp) kv_spoolwriter_free(osp->sp);
   }
   utarray_free(ospoolv);
+  utarray_free(pkeys);
+  if (vals) free(vals);
   return 0;
 }
 
@@ -16,14 +16,54 @@
 #include "kvspool_internal.h"
 #include "kvsp-bconfig.h"
 #include "ringbuf.h"
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
 
 /* 
  * publish spool over TCP in binary
+ *
+ * each frame is cast once, into a ring shared by all the clients. each
+ * client has its own position in the stream. frames stay in the ring until
+ * the space is needed, and never while a client still needs them. when
+ * the ring fills, the lag policy says what happens to the clients holding
+ * its oldest data: block (stop reading the spool til they catch up), drop
+ * (skip them ahead to the newest data) or disconnect them.
+ *
+ * the frames of a run of the publisher are a session, numbered from 0.
+ * with -r, a client first sends a hello with the session and the number
+ * of the next frame it needs; if the ring still has it, the client resumes
+ * there. so a client that reconnects gets what it missed from the ring.
+ *
+ * with -z, a client may ask in its hello for zlib compression. its stream
+ * after the hello then goes as blocks, each compressed from up to ZBLOCK
+ * bytes of the stream from its position.
  */
 
 #define BATCH_FRAMES 10000
+#define BATCH_BYTES (10 * 1024 * 1024)
 #define OUTPUT_BUFSZ (10 * 1024 * 1024)
 #define OUTPUT_CUSHION (0.2 * OUTPUT_BUFSZ)
+#define HELLO_TIMEOUT 10 /* seconds a client has to send its hello */
+
+typedef struct {
+  int fd;
+  uint64_t pos;     /* stream offset of the next byte to send it */
+  uint64_t fend;    /* first frame boundary at or after pos */
+  size_t skips;     /* times it has been skipped ahead */
+  UT_string *ctl;   /* control frames to send before the stream at pos */
+  size_t ctl_off;   /* bytes of ctl sent */
+  int events;       /* epoll events we have set for it */
+  int hello;        /* awaiting its hello */
+  time_t since;     /* ..since it connected */
+  char in[HELLO_LEN]; /* the hello read so far */
+  size_t nin;
+  int z;            /* sending zlib blocks */
+  size_t zstart;    /* ..once ctl is sent up to here (the hello) */
+  UT_string *zout;  /* the compressed block being sent */
+  size_t zoff;      /* bytes of zout sent */
+  UT_hash_handle hh;
+} client_t;
 
 struct {
   char *prog;
@@ -33,16 +73,29 @@ struct {
   uint32_t events;  /* epoll event status */
   int signal_fd;    /* to receive signals */
   int listen_fd;    /* listening tcp socket */
-  int client_fd;    /* connected tcp socket */
+  client_t *clients; /* connected tcp sockets, by fd */
+  int nclients;
+  enum {lag_block, lag_drop, lag_disconnect} lag; /* lagging client policy */
   in_addr_t addr;   /* IP address to listen on */
   int port;         /* TCP port to listen on */
   char *spool;      /* spool file name */
   void *sp;         /* spool handle */
   int spool_fd;     /* spool descriptor */
+  int spool_on;     /* spool is in epoll for reading */
+  int threads;      /* spool batch decode threads */
   char *cast;       /* cast file name */
   void *set;        /* kvspool set */
   UT_string *tmp;   /* scratch area */
   ringbuf *rb;      /* pending output */
+  uint64_t head;    /* stream offset of the end of the ring */
+  uint64_t head_seq; /* sequence number of the next frame */
+  uint64_t tail_seq; /* sequence number of the oldest frame in the ring */
+  uint64_t session; /* session id */
+  int resume;       /* clients send a hello */
+  int zlevel;       /* zlib level for clients asking for it; 0 for none */
+  UT_string *zraw;  /* stream bytes for a block */
+  uint64_t zin, zout, zns; /* bytes compressed, to bytes; cpu nanoseconds */
+  unsigned ticks;
   void *setv[BATCH_FRAMES]; /* bulk set array */
 } cfg = {
   .addr = INADDR_ANY, /* by default, listen on all local IP's */
@@ -51,7 +104,7 @@ struct {
   .signal_fd = -1,
   .listen_fd = -1,
   .spool_fd = -1,
-  .client_fd = -1,
+  .threads = 1,
 };
 
 /* signals that we'll accept via signalfd in epoll */
@@ -63,6 +116,10 @@ void usage() {
                  "               -p <port>  (TCP port to listen on)\n"
                  "               -d <spool> (spool directory to read)\n"
                  "               -b <cast>  (cast config file)\n"
+                 "               -t <n>     (decode threads) [def:1]\n"
+                 "               -L <policy> (lagging clients: block|drop|disconnect) [def:block]\n"
+                 "               -r         (resumable sessions; clients send a hello)\n"
+                 "               -z <level> (zlib for clients asking; implies -r)\n"
                  "               -v         (verbose)\n"
                  "               -h         (this help)\n"
                  "\n");
@@ -107,9 +164,29 @@ int del_epoll(int fd) {
   return rc;
 }
 
+void zlib_stats(void) {
+  fprintf(stderr,"zlib: %lu bytes to %lu (%.2f:1), %.3f cpu sec (%.0f MB/s)\n",
+          (unsigned long)cfg.zin, (unsigned long)cfg.zout,
+          cfg.zout ? (double)cfg.zin / cfg.zout : 0.0, cfg.zns / 1e9,
+          cfg.zns ? cfg.zin * 1e3 / cfg.zns : 0.0);
+}
+
+void close_client(client_t *c);
+
 /* work we do at 1hz  */
 int periodic_work(void) {
   int rc = -1;
+  client_t *c, *tmp;
+  time_t now = time(NULL);
+
+  if (cfg.verbose && cfg.zin && ((++cfg.ticks % 10) == 0)) zlib_stats();
+
+  /* drop connections that never say hello, e.g. port probes */
+  HASH_ITER(hh, cfg.clients, c, tmp) {
+    if (!c->hello || (now - c->since < HELLO_TIMEOUT)) continue;
+    fprintf(stderr,"client fd %d: no hello, disconnecting\n", c->fd);
+    close_client(c);
+  }
 
   rc = 0;
 
@@ -172,7 +249,7 @@ int setup_listener() {
   /**********************************************************
    * put socket into listening state
    *********************************************************/
-  if (listen(fd,1) == -1) {
+  if (listen(fd,SOMAXCONN) == -1) {
     fprintf(stderr,"listen: %s\n", strerror(errno));
     goto done;
   }
@@ -186,11 +263,149 @@ int setup_listener() {
   return rc;
 }
 
+/* the stream offset of the oldest byte in the ring */
+uint64_t ring_tail(void) {
+  return cfg.head - ringbuf_get_pending_size(cfg.rb);
+}
+
+/* the length prefix of the frame at stream offset off */
+uint32_t frame_len(uint64_t off) {
+  uint32_t len;
+  size_t n, have = 0;
+  char *buf;
+
+  while (have < sizeof(len)) { /* it may wrap around the ring */
+    n = ringbuf_get_chunk_at(cfg.rb, off - ring_tail() + have, &buf);
+    assert(n > 0);
+    if (n > sizeof(len) - have) n = sizeof(len) - have;
+    memcpy((char*)&len + have, buf, n);
+    have += n;
+  }
+  return len;
+}
+
+/* move fend up to the first frame boundary at or after pos */
+void find_frame(client_t *c) {
+  while (c->fend < c->pos) c->fend += sizeof(uint32_t) + frame_len(c->fend);
+}
+
+void watch_spool(int on) {
+  if (on == cfg.spool_on) return;
+  mod_epoll(on ? EPOLLIN : 0, cfg.spool_fd);
+  cfg.spool_on = on;
+}
+
+/* epoll for output on a client only when it has some pending */
+void watch_client(client_t *c) {
+  int fl = EPOLLIN;
+  if (!c->hello && ((c->ctl_off < utstring_len(c->ctl)) || (c->pos < cfg.head) ||
+                    (c->zoff < utstring_len(c->zout)))) fl |= EPOLLOUT;
+  if (fl == c->events) return;
+  mod_epoll(fl, c->fd);
+  c->events = fl;
+}
+
+/* the stream offset of the client furthest behind. a client awaiting
+ * its hello has no position yet, so holds nothing in the ring */
+uint64_t ring_low(void) {
+  uint64_t low = cfg.head;
+  client_t *c, *tmp;
+
+  HASH_ITER(hh, cfg.clients, c, tmp) if (!c->hello && (c->pos < low)) low = c->pos;
+  return low;
+}
+
+/* release the oldest frames, if no client still needs them, til the ring
+ * has the cushion free. the rest stay for clients resuming */
+void release(void) {
+  uint64_t low = ring_low(), tail = ring_tail();
+  size_t len;
+
+  while ((ringbuf_get_freespace(cfg.rb) < OUTPUT_CUSHION) && (tail < low)) {
+    len = sizeof(uint32_t) + frame_len(tail);
+    if (tail + len > low) break;
+    ringbuf_mark_consumed(cfg.rb, len);
+    tail += len;
+    cfg.tail_seq++;
+  }
+}
+
+/* reinstate/retain spool reads if output buffer has the cushion free.
+ * this must be the converse of the test handle_spool stops reading on */
+void consume(void) {
+  release();
+  if (cfg.nclients && (ringbuf_get_freespace(cfg.rb) >= OUTPUT_CUSHION)) watch_spool(1);
+}
+
+void close_client(client_t *c) {
+  if (cfg.verbose) fprintf(stderr,"client fd %d: closed, skipped %lu times\n",
+                           c->fd, (unsigned long)c->skips);
+  HASH_DEL(cfg.clients, c);
+  close(c->fd);      /* close removes client epoll */
+  utstring_free(c->ctl);
+  utstring_free(c->zout);
+  free(c);
+  cfg.nclients--;
+
+  if (cfg.nclients) consume();
+  else watch_spool(0); /* ignore spool til new client */
+}
+
+/* move a lagging client to the head of the ring. if it is partway into a
+ * frame, the rest of that frame goes to it ahead of its control frames,
+ * so the ring need not keep it */
+void skip_client(client_t *c) {
+  size_t nr;
+  char *buf;
+
+  while (c->pos < c->fend) {
+    nr = ringbuf_get_chunk_at(cfg.rb, c->pos - ring_tail(), &buf);
+    if (nr > c->fend - c->pos) nr = c->fend - c->pos;
+    utstring_bincpy(c->ctl, buf, nr);
+    c->pos += nr;
+  }
+  c->pos = c->fend = cfg.head;
+  c->skips++;
+  if (cfg.resume) hello_frame(c->ctl, cfg.session, cfg.head_seq, c->z ? HELLO_ZLIB : 0);
+  dict_snapshot(c->ctl); /* the dictionaries as of the head */
+  if (cfg.verbose) fprintf(stderr,"client fd %d: lagging, skipped ahead\n", c->fd);
+}
+
+/* the ring is nearly full. apply the lag policy to the clients holding its
+ * oldest data, for as long as that frees some of it */
+void relieve(void) {
+  client_t *c, *tmp;
+  uint64_t low;
+  int moved;
+
+  if (cfg.lag == lag_block) return;
+
+  do {
+    moved = 0;
+    low = ring_low();
+    HASH_ITER(hh, cfg.clients, c, tmp) {
+      if (c->hello || (c->pos != low)) continue;
+      /* one that hasn't even taken what its last skip gave it is hung */
+      if ((cfg.lag == lag_disconnect) || (c->ctl_off < utstring_len(c->ctl))) {
+        fprintf(stderr,"client fd %d: lagging, disconnecting\n", c->fd);
+        close_client(c);
+        moved = 1;
+      } else {
+        skip_client(c);
+        watch_client(c);
+        moved = 1;
+      }
+    }
+    if (moved) release();
+  } while (moved && cfg.nclients && (ringbuf_get_freespace(cfg.rb) < OUTPUT_CUSHION));
+}
+
 /* accept a new client connection to the listening socket */
 int accept_client() {
   int fd=-1, rc=-1;
   struct sockaddr_in in;
   socklen_t sz = sizeof(in);
+  client_t *c;
 
   fd = accept(cfg.listen_fd,(struct sockaddr*)&in, &sz);
   if (fd == -1) {
@@ -203,136 +418,288 @@ int accept_client() {
     inet_ntoa(in.sin_addr), (int)ntohs(in.sin_port));
   }
 
-  if (cfg.client_fd != -1) { /* already have a client? */
-    fprintf(stderr,"refusing client\n");
-    close(fd);
-    rc = 0;
+  /* a slow client must not hold up the others */
+  if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) == -1) {
+    fprintf(stderr,"fcntl: %s\n", strerror(errno));
     goto done;
   }
 
-  cfg.client_fd = fd;
+  if ( (c = calloc(1, sizeof(*c))) == NULL) {
+    fprintf(stderr,"out of memory\n");
+    goto done;
+  }
+  utstring_new(c->ctl);
+  utstring_new(c->zout);
+  c->fd = fd;
+  c->pos = c->fend = cfg.head; /* it joins at the head of the stream */
+  c->since = time(NULL);
+  if (cfg.resume) c->hello = 1;   /* ..or where its hello says */
+  else dict_snapshot(c->ctl);
+  HASH_ADD_INT(cfg.clients, fd, c);
+  cfg.nclients++;
+  fd = -1;
 
   /* epoll on both the spool and the client */
-  if (add_epoll(EPOLLIN, cfg.client_fd) < 0) goto done;
-  mod_epoll(EPOLLIN, cfg.spool_fd);
+  c->events = EPOLLIN;
+  if (add_epoll(EPOLLIN, c->fd) < 0) goto done;
+  watch_client(c);
+  consume();
 
   rc = 0;
 
  done:
+  if (fd != -1) close(fd);
   return rc;
 }
 
 int handle_spool(void) {
   int rc = -1, sc, i=0;
+  client_t *c, *tmp;
   char *buf;
-  size_t len;
-  int fl, nset;
+  size_t len, sz;
+  int nset;
 
   /* suspend spool reading if output buffer < 20% free */
+  release();
+  if (ringbuf_get_freespace(cfg.rb) < OUTPUT_CUSHION) relieve();
   if (ringbuf_get_freespace(cfg.rb) < OUTPUT_CUSHION) {
-    mod_epoll(0, cfg.spool_fd);
+    watch_spool(0);
     rc = 0;
     goto done;
   }
 
   nset = BATCH_FRAMES;
 
-  sc = kv_spool_readN(cfg.sp, cfg.setv, &nset);
+  sc = kv_spool_readN_view(cfg.sp, cfg.setv, &nset);
   if (sc < 0) {
-    fprintf(stderr, "kv_spool_readN: error\n");
+    fprintf(stderr, "kv_spool_readN_view: error\n");
     goto done;
   }
 
   if (cfg.verbose) fprintf(stderr,"%d sets\n", nset);
 
+  /* each frame is cast once, for all the clients */
   for(i=0; i < nset; i++) {
 
-    sc = set_to_binary(cfg.setv[i], cfg.tmp);
-    if (sc < 0) goto done;
-
-    buf = utstring_body(cfg.tmp);
-    len = utstring_len(cfg.tmp);
-    sc = ringbuf_put(cfg.rb, buf, len);
-    if (sc < 0) {
-      /* unexpected; we checked it was 20% free */
-      fprintf(stderr, "buffer exhausted\n");
-      goto done;
+    /* encode in place at the ring input when it fits there */
+    sz = set_binary_size(cfg.setv[i]);
+    if (sz == 0) goto done;
+    buf = ringbuf_reserve(cfg.rb, sz);
+    if (buf) {
+      sc = set_binary_encode(buf, &len);
+      if (sc < 0) goto done;
+      if (sc > 0) continue; /* bad value; skipped */
+      ringbuf_commit(cfg.rb, len);
+    } else {
+      sc = set_to_binary(cfg.setv[i], cfg.tmp);
+      if (sc < 0) goto done;
+      if (sc > 0) continue;
+      buf = utstring_body(cfg.tmp);
+      len = utstring_len(cfg.tmp);
+      sc = ringbuf_put(cfg.rb, buf, len);
+      if (sc < 0) {
+        /* unexpected; we checked it was 20% free */
+        fprintf(stderr, "buffer exhausted\n");
+        goto done;
+      }
     }
+    cfg.head += len;
+    cfg.head_seq++;
   }
 
-  fl = EPOLLIN | (ringbuf_get_pending_size(cfg.rb) ? EPOLLOUT : 0);
-  mod_epoll(fl, cfg.client_fd);
+  HASH_ITER(hh, cfg.clients, c, tmp) watch_client(c);
   rc = 0;
 
  done:
   return rc;
 }
 
-void close_client(void) {
-  ringbuf_clear(cfg.rb);
-  mod_epoll(0,cfg.spool_fd); /* ignore spool til new client */
-  close(cfg.client_fd);      /* close removes client epoll */
-  cfg.client_fd = -1;
-  cfg.events = 0;
+/* start the client where its hello says, if the ring still has it */
+int start_client(client_t *c) {
+  uint64_t session, seq, pos, n;
+  uint8_t flags;
+  uint32_t hdr;
+
+  memcpy(&hdr, c->in, sizeof(hdr));
+  if ((hdr != ((HELLO_LEN - sizeof(hdr)) | CTL_FRAME)) ||
+      (hello_parse(c->in + sizeof(hdr), HELLO_LEN - sizeof(hdr), &session, &seq, &flags) < 0)) {
+    fprintf(stderr,"client fd %d: bad hello\n", c->fd);
+    return -1;
+  }
+
+  if ((session == cfg.session) && (seq <= cfg.head_seq)) {
+    if (seq < cfg.tail_seq) {
+      fprintf(stderr,"client fd %d: frames %lu-%lu no longer held\n", c->fd,
+              (unsigned long)seq, (unsigned long)cfg.tail_seq-1);
+      seq = cfg.tail_seq;
+    }
+    pos = ring_tail();
+    for(n=cfg.tail_seq; n < seq; n++) pos += sizeof(uint32_t) + frame_len(pos);
+  } else {
+    if (session) fprintf(stderr,"client fd %d: session %lx unknown, starting anew\n",
+                         c->fd, (unsigned long)session);
+    seq = cfg.head_seq;
+    pos = cfg.head;
+  }
+  if (cfg.verbose) fprintf(stderr,"client fd %d: starting at frame %lu\n", c->fd,
+                           (unsigned long)seq);
+
+  c->pos = c->fend = pos;
+  c->hello = 0;
+  flags &= cfg.zlevel ? HELLO_ZLIB : 0;
+  hello_frame(c->ctl, cfg.session, seq, flags);
+  if (flags & HELLO_ZLIB) c->zstart = utstring_len(c->ctl); /* blocks after */
+  dict_snapshot(c->ctl); /* as of the head, a superset of what it needs */
+  watch_client(c);
+  return 0;
 }
 
-void drain_client(void) {
+/* returns -1 if the client was closed */
+int drain_client(client_t *c) {
   char buf[1024];
   ssize_t nr;
 
-  nr = read(cfg.client_fd, buf, sizeof(buf));
+  if (c->hello) nr = read(c->fd, c->in + c->nin, HELLO_LEN - c->nin);
+  else nr = read(c->fd, buf, sizeof(buf));
   if(nr > 0) { 
     if (cfg.verbose) fprintf(stderr,"client: %lu bytes\n", (long unsigned)nr);
-    return;
+    if (c->hello && ((c->nin += nr) == HELLO_LEN) && (start_client(c) < 0)) {
+      close_client(c);
+      return -1;
+    }
+    return 0;
   }
+  if ((nr < 0) && ((errno == EAGAIN) || (errno == EINTR))) return 0;
 
   /* disconnect or socket error are handled the same - close it */
-  assert(nr <= 0);
   fprintf(stderr,"client: %s\n", nr ? strerror(errno) : "closed");
-  close_client();
+  close_client(c);
+  return -1;
 }
 
-void send_client(void) {
-  size_t nr, wr;
+#ifdef HAVE_ZLIB
+/* compress the client's next ZBLOCK of stream, its control frames then the
+ * ring from its position, into zout */
+int fill_block(client_t *c) {
+  size_t nr, len;
+  uint32_t hdr[2];
+  uLongf zlen;
+  char *buf;
+  struct timespec t1, t2;
+
+  utstring_clear(cfg.zraw);
+  while ( (len = utstring_len(cfg.zraw)) < ZBLOCK) {
+    if (c->ctl_off < utstring_len(c->ctl)) {
+      nr = utstring_len(c->ctl) - c->ctl_off;
+      if (nr > ZBLOCK - len) nr = ZBLOCK - len;
+      utstring_bincpy(cfg.zraw, utstring_body(c->ctl) + c->ctl_off, nr);
+      c->ctl_off += nr;
+      if (c->ctl_off == utstring_len(c->ctl)) {
+        utstring_clear(c->ctl);
+        c->ctl_off = 0;
+      }
+      continue;
+    }
+    if (c->pos == cfg.head) break;
+    nr = ringbuf_get_chunk_at(cfg.rb, c->pos - ring_tail(), &buf);
+    if (nr > ZBLOCK - len) nr = ZBLOCK - len;
+    utstring_bincpy(cfg.zraw, buf, nr);
+    c->pos += nr;
+    find_frame(c);
+  }
+  assert(len > 0);
+
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &t1);
+  zlen = compressBound(len);
+  utstring_clear(c->zout);
+  utstring_reserve(c->zout, ZBLOCK_HDR + zlen);
+  if (compress2((Bytef*)utstring_body(c->zout) + ZBLOCK_HDR, &zlen,
+                (Bytef*)utstring_body(cfg.zraw), len, cfg.zlevel) != Z_OK) {
+    fprintf(stderr,"compress2: failed\n");
+    return -1;
+  }
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &t2);
+  hdr[0] = zlen;
+  hdr[1] = len;
+  memcpy(utstring_body(c->zout), hdr, ZBLOCK_HDR);
+  c->zout->i = ZBLOCK_HDR + zlen;
+  c->zoff = 0;
+
+  cfg.zin += len;
+  cfg.zout += ZBLOCK_HDR + zlen;
+  cfg.zns += (t2.tv_sec - t1.tv_sec) * 1000000000L + (t2.tv_nsec - t1.tv_nsec);
+  consume();
+  return 0;
+}
+#endif
+
+/* write what we can of the client's control frames, then of the ring from
+ * its position (or of its next zlib block); returns -1 if the client was
+ * closed */
+int send_client(client_t *c) {
+  size_t nr, nc;
+  ssize_t wr;
   char *buf;
-  int fl;
 
-  nr = ringbuf_get_next_chunk(cfg.rb, &buf);
+  nc = utstring_len(c->ctl) - c->ctl_off;
+  if (c->z) {
+#ifdef HAVE_ZLIB
+    if ((c->zoff == utstring_len(c->zout)) && (fill_block(c) < 0)) {
+      close_client(c);
+      return -1;
+    }
+#endif
+    buf = utstring_body(c->zout) + c->zoff;
+    nr = utstring_len(c->zout) - c->zoff;
+  } else if (nc) {
+    buf = utstring_body(c->ctl) + c->ctl_off;
+    nr = c->zstart ? c->zstart - c->ctl_off : nc;
+  } else {
+    nr = ringbuf_get_chunk_at(cfg.rb, c->pos - ring_tail(), &buf);
+  }
   assert(nr > 0);
 
-  wr = write(cfg.client_fd, buf, nr);
+  wr = write(c->fd, buf, nr);
   if (wr < 0) {
+    if ((errno == EAGAIN) || (errno == EINTR)) return 0;
     fprintf(stderr, "write: %s\n", strerror(errno));
-    close_client();
-    return;
+    close_client(c);
+    return -1;
   }
 
-  ringbuf_mark_consumed(cfg.rb, wr);
+  if (c->z) c->zoff += wr;
+  else if (nc) {
+    c->ctl_off += wr;
+    if (c->zstart && (c->ctl_off == c->zstart)) {
+      c->z = 1; /* the rest goes in blocks */
+      c->zstart = 0;
+    }
+    if (c->ctl_off == utstring_len(c->ctl)) {
+      utstring_clear(c->ctl);
+      c->ctl_off = 0;
+    }
+  } else {
+    c->pos += wr;
+    find_frame(c);
+    consume();
+  }
 
   /* adjust epoll on client based on we have more output to send */
-  fl = EPOLLIN | (ringbuf_get_pending_size(cfg.rb) ? EPOLLOUT : 0);
-  mod_epoll(fl, cfg.client_fd);
-
-  /* reinstate/retain spool reads if output buffer is > 20% free */
-  if (ringbuf_get_freespace(cfg.rb) > OUTPUT_CUSHION) {
-    mod_epoll(EPOLLIN, cfg.spool_fd);
-  }
+  watch_client(c);
+  return 0;
 }
 
-int handle_client() {
-  int rc = -1;
-  assert(cfg.client_fd != -1);
-
-  if (cfg.events & EPOLLIN) drain_client();
-  if (cfg.events & EPOLLOUT) send_client();
-
-  rc = 0;
-  return rc;
+int handle_client(client_t *c) {
+  if ((cfg.events & (EPOLLIN|EPOLLHUP|EPOLLERR)) && (drain_client(c) < 0)) return 0;
+  if (cfg.events & EPOLLOUT) send_client(c);
+  return 0;
 }
 
 int main(int argc, char *argv[]) {
   int opt, rc=-1, n, ec, i;
   struct epoll_event ev;
+  client_t *client, *tmp;
+  struct timeval tv;
   cfg.prog = argv[0];
   char unit, *c, buf[100];
   ssize_t nr;
@@ -341,27 +708,53 @@ int main(int argc, char *argv[]) {
   utarray_new(output_defaults, &ut_str_icd);
   utarray_new(output_types,&ut_int_icd);
   cfg.set = kv_set_new();
-  for(i=0; i < BATCH_FRAMES; i++) cfg.setv[i] = kv_set_new();
   utstring_new(cfg.tmp);
-  cfg.rb = ringbuf_new(OUTPUT_BUFSZ);
+  utstring_new(cfg.zraw);
+  /* mirrored, pending output never splits at the wrap */
+  cfg.rb = ringbuf_new_mirror(OUTPUT_BUFSZ);
+  if (cfg.rb == NULL) cfg.rb = ringbuf_new(OUTPUT_BUFSZ);
+  gettimeofday(&tv, NULL); /* a session id unlikely to recur */
+  cfg.session = ((uint64_t)tv.tv_sec << 32) ^ ((uint64_t)tv.tv_usec << 12) ^ getpid();
   if (cfg.rb == NULL) goto done;
 
-  while ( (opt = getopt(argc,argv,"vhp:d:b:")) > 0) {
+  while ( (opt = getopt(argc,argv,"vhp:d:b:t:L:rz:")) > 0) {
     switch(opt) {
       case 'v': cfg.verbose++; break;
       case 'h': default: usage(); break;
       case 'p': cfg.port = atoi(optarg); break;
       case 'd': cfg.spool = strdup(optarg); break;
       case 'b': cfg.cast = strdup(optarg); break;
+      case 't': cfg.threads = atoi(optarg); break;
+      case 'r': cfg.resume = 1; break;
+      case 'z': cfg.zlevel = atoi(optarg); cfg.resume = 1; break;
+      case 'L': 
+        if (!strcmp(optarg,"block")) cfg.lag = lag_block;
+        else if (!strcmp(optarg,"drop")) cfg.lag = lag_drop;
+        else if (!strcmp(optarg,"disconnect")) cfg.lag = lag_disconnect;
+        else usage();
+        break;
     }
   }
 
   if (cfg.spool == NULL) usage();
   if (cfg.cast == NULL) usage();
+  if ((cfg.zlevel < 0) || (cfg.zlevel > 9)) usage();
+#ifndef HAVE_ZLIB
+  if (cfg.zlevel) {
+    fprintf(stderr,"-z: built without zlib\n");
+    goto done;
+  }
+#endif
   
   if (parse_config(cfg.cast) < 0) goto done;
+  for(i=0; i < BATCH_FRAMES; i++) cfg.setv[i] = kv_set_new_schema(output_schema);
   cfg.sp = kv_spoolreader_new_nb(cfg.spool, &cfg.spool_fd);
   if (cfg.sp == NULL) goto done;
+  kv_spoolreader_batch(cfg.sp, BATCH_BYTES, 1);
+  if (kv_spoolreader_threads(cfg.sp, cfg.threads) < 0) goto done;
+  /* only the cast keys are needed; skip the rest when decoding */
+  if (kv_spoolreader_project(cfg.sp, (const char**)utarray_front(output_keys),
+                             utarray_len(output_keys)) < 0) goto done;
 
   /* block all signals. we accept signals via signal_fd */
   sigset_t all;
@@ -407,9 +800,12 @@ int main(int argc, char *argv[]) {
     if (ec == 0)                          { assert(0); goto done; }
     else if (ev.data.fd == cfg.signal_fd) { if (handle_signal()  < 0) goto done; }
     else if (ev.data.fd == cfg.listen_fd) { if (accept_client() < 0) goto done; }
-    else if (ev.data.fd == cfg.client_fd) { if (handle_client() < 0) goto done; }
     else if (ev.data.fd == cfg.spool_fd)  { if (handle_spool() < 0) goto done; }
-    else                                  { assert(0); goto done; }
+    else {
+      HASH_FIND_INT(cfg.clients, &ev.data.fd, client);
+      if (client == NULL) { assert(0); goto done; }
+      if (handle_client(client) < 0) goto done;
+    }
   }
   
   rc = 0;
@@ -418,11 +814,19 @@ int main(int argc, char *argv[]) {
   if (cfg.signal_fd != -1) close(cfg.signal_fd);
   if (cfg.epoll_fd != -1) close(cfg.epoll_fd);
   if (cfg.listen_fd != -1) close(cfg.listen_fd);
-  if (cfg.client_fd != -1) close(cfg.client_fd);
+  HASH_ITER(hh, cfg.clients, client, tmp) {
+    HASH_DEL(cfg.clients, client);
+    close(client->fd);
+    utstring_free(client->ctl);
+    utstring_free(client->zout);
+    free(client);
+  }
   if (cfg.sp) kv_spoolreader_free(cfg.sp);
   kv_set_free(cfg.set);
-  for(i=0; i < BATCH_FRAMES; i++) kv_set_free(cfg.setv[i]);
+  for(i=0; i < BATCH_FRAMES; i++) if (cfg.setv[i]) kv_set_free(cfg.setv[i]);
   utstring_free(cfg.tmp);
+  utstring_free(cfg.zraw);
+  if (cfg.verbose && cfg.zin) zlib_stats();
   if (cfg.rb) ringbuf_free(cfg.rb);
   return 0;
 }
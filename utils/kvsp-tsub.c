@@ -18,6 +18,9 @@
 #include "utstring.h"
 #include "kvspool_internal.h"
 #include "kvsp-bconfig.h"
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
 
 /* 
  * kvsp-tsub
@@ -27,10 +30,23 @@
  * reverse to kv set
  * write to local spool
  *
+ * the frames from each read are unpacked into an array of sets and
+ * written to the spool as a batch
+ *
+ * with -r, it resumes the publisher's session: it counts the frames it
+ * has written, and on connecting sends a hello with the session and that
+ * count. if the connection drops it reconnects, each second, and the
+ * publisher replays what it has of the frames since.
+ *
+ * with -z, it asks in the hello for zlib; if the publisher agrees, the
+ * stream after its hello comes as compressed blocks, which are inflated
+ * into the receive buffer ahead of decoding.
+ *
  */
 
 #define MAX_FRAME (1024*1024)
 #define BUFSZ (MAX_FRAME * 10)
+#define BATCH_FRAMES 10000
 struct {
   char *prog;
   int verbose;
@@ -42,10 +58,21 @@ struct {
   char *cast;       /* cast config file name */
   char *spool;      /* spool file name */
   void *sp;         /* spool handle */
-  void *set;        /* set handle */
+  void *setv[BATCH_FRAMES]; /* bulk set array */
+  int nset;         /* sets decoded, not yet written */
   UT_string *tmp;   /* temp buffer */
   char buf[BUFSZ];  /* temp receive buffer */
   size_t bsz;       /* bytes ready in buf */
+  int resume;       /* resume the session when reconnecting */
+  int hello;        /* awaiting the publisher's hello */
+  uint64_t session; /* publisher session id */
+  uint64_t seq;     /* sequence number of the next frame */
+  int zlib;         /* ask for zlib blocks */
+  int z;            /* receiving zlib blocks */
+  char zbuf[BUFSZ]; /* compressed receive buffer */
+  size_t zsz;       /* bytes ready in zbuf */
+  uint64_t zin, zout, zns; /* bytes inflated, from bytes; cpu nanoseconds */
+  unsigned ticks;
 } cfg = {
   .host = "127.0.0.1",
   .epoll_fd = -1,
@@ -64,12 +91,38 @@ void usage() {
                  "               -b <file>  (cast config)\n"
                  "               -d <spool> (spool dir)\n"
                  "other options:\n"
+                 "               -r         (resume session, reconnect)\n"
+                 "               -z         (ask for zlib compression)\n"
                  "               -v         (verbose)\n"
                  "               -h         (this help)\n"
                  "\n");
   exit(-1);
 }
 
+int add_epoll(int events, int fd) {
+  int rc;
+  struct epoll_event ev;
+  memset(&ev,0,sizeof(ev)); // placate valgrind
+  ev.events = events;
+  ev.data.fd= fd;
+  if (cfg.verbose) fprintf(stderr,"adding fd %d to epoll\n", fd);
+  rc = epoll_ctl(cfg.epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+  if (rc == -1) {
+    fprintf(stderr,"epoll_ctl: %s\n", strerror(errno));
+  }
+  return rc;
+}
+
+int del_epoll(int fd) {
+  int rc;
+  struct epoll_event ev;
+  rc = epoll_ctl(cfg.epoll_fd, EPOLL_CTL_DEL, fd, &ev);
+  if (rc == -1) {
+    fprintf(stderr,"epoll_ctl: %s\n", strerror(errno));
+  }
+  return rc;
+}
+
 int connect_up(void) {
   int rc = -1, fd = -1;
 
@@ -95,7 +148,22 @@ int connect_up(void) {
     goto done;
   }
 
+  if (cfg.resume || cfg.zlib) {
+    utstring_clear(cfg.tmp);
+    hello_frame(cfg.tmp, cfg.session, cfg.seq, cfg.zlib ? HELLO_ZLIB : 0);
+    if (write(fd, utstring_body(cfg.tmp), utstring_len(cfg.tmp)) != HELLO_LEN) {
+      fprintf(stderr,"write: %s\n", strerror(errno));
+      goto done;
+    }
+    cfg.hello = 1;
+  }
+
+  if ((cfg.epoll_fd != -1) && (add_epoll(EPOLLIN, fd) < 0)) goto done;
   cfg.client_fd = fd;
+  cfg.bsz = 0;
+  cfg.zsz = 0;
+  cfg.z = 0;
+  dict_reset(); /* the publisher starts a new stream */
   rc = 0;
 
  done:
@@ -103,34 +171,28 @@ int connect_up(void) {
   return rc;
 }
 
-int add_epoll(int events, int fd) {
-  int rc;
-  struct epoll_event ev;
-  memset(&ev,0,sizeof(ev)); // placate valgrind
-  ev.events = events;
-  ev.data.fd= fd;
-  if (cfg.verbose) fprintf(stderr,"adding fd %d to epoll\n", fd);
-  rc = epoll_ctl(cfg.epoll_fd, EPOLL_CTL_ADD, fd, &ev);
-  if (rc == -1) {
-    fprintf(stderr,"epoll_ctl: %s\n", strerror(errno));
-  }
-  return rc;
+/* drop the connection, to reconnect */
+void disconnect(void) {
+  del_epoll(cfg.client_fd);
+  close(cfg.client_fd);
+  cfg.client_fd = -1;
 }
 
-int del_epoll(int fd) {
-  int rc;
-  struct epoll_event ev;
-  rc = epoll_ctl(cfg.epoll_fd, EPOLL_CTL_DEL, fd, &ev);
-  if (rc == -1) {
-    fprintf(stderr,"epoll_ctl: %s\n", strerror(errno));
-  }
-  return rc;
+/* work we do at 1hz  */
+void zlib_stats(void) {
+  fprintf(stderr,"zlib: %lu bytes from %lu (%.2f:1), %.3f cpu sec (%.0f MB/s)\n",
+          (unsigned long)cfg.zin, (unsigned long)cfg.zout,
+          cfg.zout ? (double)cfg.zin / cfg.zout : 0.0, cfg.zns / 1e9,
+          cfg.zns ? cfg.zin * 1e3 / cfg.zns : 0.0);
 }
 
-/* work we do at 1hz  */
 int periodic_work(void) {
   int rc = -1;
 
+  if (cfg.verbose && cfg.zin && ((++cfg.ticks % 10) == 0)) zlib_stats();
+
+  if (cfg.resume && (cfg.client_fd == -1)) connect_up();
+
   rc = 0;
 
  done:
@@ -163,6 +225,44 @@ int handle_signal(void) {
   return rc;
 }
 
+/* write out the decoded sets */
+int flush_sets(void) {
+  int rc = -1;
+
+  if (cfg.nset == 0) return 0;
+  if (kv_spool_writeN(cfg.sp, cfg.setv, cfg.nset) < 0) goto done;
+  if (cfg.verbose > 1) fprintf(stderr,"%d sets\n", cfg.nset);
+  cfg.seq += cfg.nset;
+  cfg.nset = 0;
+  rc = 0;
+
+ done:
+  return rc;
+}
+
+/* the publisher's hello says where the frames start */
+int handle_hello(char *body, uint32_t blen) {
+  uint64_t session, seq;
+  uint8_t flags;
+
+  if (flush_sets() < 0) return -1; /* count the frames before it */
+  if (hello_parse(body, blen, &session, &seq, &flags) < 0) return -1;
+  if (cfg.session && (session != cfg.session)) {
+    fprintf(stderr,"new publisher session; frames since %lu may be lost\n",
+            (unsigned long)cfg.seq);
+  } else if (cfg.session && (seq != cfg.seq)) {
+    fprintf(stderr,"publisher skipped frames %lu-%lu\n", (unsigned long)cfg.seq,
+            (unsigned long)seq-1);
+  }
+  if (cfg.verbose) fprintf(stderr,"session %lx from frame %lu\n",
+                           (unsigned long)session, (unsigned long)seq);
+  cfg.session = session;
+  cfg.seq = seq;
+  cfg.hello = 0;
+  if (flags & HELLO_ZLIB) cfg.z = 1;
+  return 0;
+}
+
 /*
  * given a buffer of N frames 
  * with a possible partial final frame
@@ -171,21 +271,42 @@ int handle_signal(void) {
  */
 int decode_frames(void) {
   char *c, *body, *eob;
-  uint32_t blen;
+  uint32_t blen, ctl;
   size_t remsz;
-  int rc = -1;
+  int rc = -1, z;
 
   eob = cfg.buf + cfg.bsz;
   c = cfg.buf;
   while(1) {
     if (c + sizeof(uint32_t) > eob) break;
     memcpy(&blen, c, sizeof(uint32_t));
+    ctl = blen & CTL_FRAME;
+    blen &= ~CTL_FRAME;
     if (blen > MAX_FRAME) goto done;
     body = c + sizeof(uint32_t);
     if (body + blen > eob) break;
-    if (binary_to_frame(cfg.sp, cfg.set, body, blen, cfg.tmp) < 0) goto done;
+    if (ctl && blen && (*body == CTL_HELLO)) {
+      z = cfg.z;
+      if ((cfg.resume || cfg.zlib) && (handle_hello(body, blen) < 0)) goto done;
+      if (cfg.z && !z) { /* the rest of the stream is zlib blocks */
+        c = body + blen;
+        memcpy(cfg.zbuf, c, eob - c);
+        cfg.zsz = eob - c;
+        c = eob;
+        break;
+      }
+    }
+    else if (ctl) { if (control_frame(body, blen) < 0) goto done; }
+    else if (cfg.hello) {
+      fprintf(stderr, "publisher sent no hello; is it using -r or -z?\n");
+      goto done;
+    } else {
+      if (binary_to_set(cfg.setv[cfg.nset], body, blen, cfg.tmp) < 0) goto done;
+      if ((++cfg.nset == BATCH_FRAMES) && (flush_sets() < 0)) goto done;
+    }
     c += sizeof(uint32_t) + blen;
   }
+  if (flush_sets() < 0) goto done;
 
   /* if buffer ends with partial frame, save it */
   if (c < eob) memmove(cfg.buf, c, eob - c);
@@ -198,6 +319,52 @@ int decode_frames(void) {
   return rc;
 }
 
+/* inflate the whole blocks in zbuf, decoding each */
+int inflate_blocks(void) {
+  int rc = -1;
+#ifdef HAVE_ZLIB
+  char *c = cfg.zbuf, *eob = cfg.zbuf + cfg.zsz;
+  struct timespec t1, t2;
+  uint32_t hdr[2];
+  uLongf rlen;
+
+  while (c + ZBLOCK_HDR <= eob) {
+    memcpy(hdr, c, ZBLOCK_HDR);
+    if ((hdr[1] > ZBLOCK) || (hdr[0] > compressBound(ZBLOCK))) {
+      fprintf(stderr, "bad zlib block header\n");
+      goto done;
+    }
+    if (c + ZBLOCK_HDR + hdr[0] > eob) break;
+
+    /* decode_frames leaves at most a partial frame in buf */
+    assert(BUFSZ - cfg.bsz >= ZBLOCK);
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &t1);
+    rlen = BUFSZ - cfg.bsz;
+    if ((uncompress((Bytef*)cfg.buf + cfg.bsz, &rlen, (Bytef*)c + ZBLOCK_HDR,
+                    hdr[0]) != Z_OK) || (rlen != hdr[1])) {
+      fprintf(stderr, "bad zlib block\n");
+      goto done;
+    }
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &t2);
+    cfg.zin += rlen;
+    cfg.zout += ZBLOCK_HDR + hdr[0];
+    cfg.zns += (t2.tv_sec - t1.tv_sec) * 1000000000L + (t2.tv_nsec - t1.tv_nsec);
+
+    cfg.bsz += rlen;
+    if (decode_frames() < 0) goto done;
+    c += ZBLOCK_HDR + hdr[0];
+  }
+
+  /* if buffer ends with partial block, save it */
+  if (c < eob) memmove(cfg.zbuf, c, eob - c);
+  cfg.zsz = eob - c;
+  rc = 0;
+
+ done:
+#endif
+  return rc;
+}
+
 /*
  * read from the publisher
  * each frame is prefixed with a uint32 length
@@ -214,14 +381,22 @@ int handle_io(void) {
   assert(cfg.bsz < BUFSZ);
   avail = BUFSZ - cfg.bsz;
 
-  nr = read(cfg.client_fd, cfg.buf + cfg.bsz, avail);
+  if (cfg.z) {
+    assert(cfg.zsz < BUFSZ);
+    nr = read(cfg.client_fd, cfg.zbuf + cfg.zsz, BUFSZ - cfg.zsz);
+  } else nr = read(cfg.client_fd, cfg.buf + cfg.bsz, avail);
   if (nr <= 0) {
     fprintf(stderr, "read: %s\n", nr ? strerror(errno) : "eof");
+    if (cfg.resume) { disconnect(); rc = 0; }
     goto done;
   }
 
-  cfg.bsz += nr;
-  if (decode_frames() < 0) goto done;
+  if (cfg.z) cfg.zsz += nr;
+  else {
+    cfg.bsz += nr;
+    if (decode_frames() < 0) goto done;
+  }
+  if (cfg.z && (inflate_blocks() < 0)) goto done; /* maybe from the hello on */
 
   rc = 0;
 
@@ -230,7 +405,7 @@ int handle_io(void) {
 }
 
 int main(int argc, char *argv[]) {
-  int opt, rc=-1, n, ec;
+  int opt, rc=-1, n, ec, i;
   struct epoll_event ev;
   cfg.prog = argv[0];
   char unit, *c, buf[100];
@@ -238,13 +413,12 @@ int main(int argc, char *argv[]) {
   ssize_t nr;
 
   utstring_new(cfg.tmp);
-  cfg.set = kv_set_new();
 
   utarray_new(output_keys, &ut_str_icd);
   utarray_new(output_defaults, &ut_str_icd);
   utarray_new(output_types,&ut_int_icd);
 
-  while ( (opt = getopt(argc,argv,"vhs:p:d:b:")) > 0) {
+  while ( (opt = getopt(argc,argv,"vhs:p:d:b:rz")) > 0) {
     switch(opt) {
       case 'v': cfg.verbose++; break;
       case 'h': default: usage(); break;
@@ -252,6 +426,8 @@ int main(int argc, char *argv[]) {
       case 'p': cfg.port = atoi(optarg); break;
       case 'd': cfg.spool = strdup(optarg); break;
       case 'b': cfg.cast = strdup(optarg); break;
+      case 'r': cfg.resume = 1; break;
+      case 'z': cfg.zlib = 1; break;
     }
   }
 
@@ -261,10 +437,17 @@ int main(int argc, char *argv[]) {
   if (cfg.port == 0) usage();
 
   if (parse_config(cfg.cast) < 0) goto done;
+  for(i=0; i < BATCH_FRAMES; i++) cfg.setv[i] = kv_set_new_schema(output_schema);
   cfg.sp = kv_spoolwriter_new(cfg.spool);
   if (cfg.sp == NULL) goto done;
 
-  if (connect_up() < 0) goto done;
+#ifndef HAVE_ZLIB
+  if (cfg.zlib) {
+    fprintf(stderr,"-z: built without zlib\n");
+    goto done;
+  }
+#endif
+  if ((connect_up() < 0) && !cfg.resume) goto done; /* or retry */
   
   /* block all signals. we accept signals via signal_fd */
   sigset_t all;
@@ -292,7 +475,7 @@ int main(int argc, char *argv[]) {
 
   /* add descriptors of interest */
   if (add_epoll(EPOLLIN, cfg.signal_fd)) goto done;
-  if (add_epoll(EPOLLIN, cfg.client_fd)) goto done;
+  if ((cfg.client_fd != -1) && add_epoll(EPOLLIN, cfg.client_fd)) goto done;
 
   alarm(1);
 
@@ -316,8 +499,9 @@ int main(int argc, char *argv[]) {
   utarray_free(output_defaults);
   utarray_free(output_types);
   utstring_free(cfg.tmp);
+  if (cfg.verbose && cfg.zin) zlib_stats();
   if (cfg.sp) kv_spoolwriter_free(cfg.sp);
-  if (cfg.set) kv_set_free(cfg.set);
+  for(i=0; i < BATCH_FRAMES; i++) if (cfg.setv[i]) kv_set_free(cfg.setv[i]);
   if (cfg.signal_fd != -1) close(cfg.signal_fd);
   if (cfg.epoll_fd != -1) close(cfg.epoll_fd);
   if (cfg.client_fd != -1) close(cfg.client_fd);
@@ -1,3 +1,8 @@
+#define _GNU_SOURCE /* memfd_create */
+#include <sys/mman.h>
+#include <errno.h>
+#include <stddef.h>
+#include <unistd.h>
 #include "ringbuf.h"
 
 ringbuf *ringbuf_new(size_t sz) {
@@ -7,15 +12,70 @@ ringbuf *ringbuf_new(size_t sz) {
     goto done;
   }
 
+  r->u = r->i = r->o = r->m = 0;
+  r->n = sz;
+
+ done:
+  return r;
+}
+
+/* ringbuf_new_mirror: alternative to ringbuf_new whose data is mapped
+ * twice, back to back, so the pending output and the free space are each
+ * one contiguous span however they wrap. the size is rounded up to a
+ * whole number of pages. returns NULL where that can't be done; callers
+ * can fall back to ringbuf_new. the header sits at the end of a page of
+ * its own, ahead of the data.
+ */
+ringbuf *ringbuf_new_mirror(size_t sz) {
+  ringbuf *r = NULL;
+#ifdef MFD_CLOEXEC
+  size_t pg = sysconf(_SC_PAGESIZE);
+  int prot = PROT_READ|PROT_WRITE;
+  char *base = MAP_FAILED;
+  int fd = -1;
+
+  sz = (sz + pg - 1) / pg * pg;
+  fd = memfd_create("ringbuf", MFD_CLOEXEC);
+  if (fd == -1) {
+    fprintf(stderr,"memfd_create: %s\n", strerror(errno));
+    goto done;
+  }
+  if (ftruncate(fd, sz) == -1) {
+    fprintf(stderr,"ftruncate: %s\n", strerror(errno));
+    goto done;
+  }
+
+  /* reserve the span, then map the header page and the data twice in it */
+  base = mmap(NULL, pg + 2*sz, PROT_NONE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if (base == MAP_FAILED) {
+    fprintf(stderr,"mmap: %s\n", strerror(errno));
+    goto done;
+  }
+  if ((mmap(base, pg, prot, MAP_PRIVATE|MAP_ANONYMOUS|MAP_FIXED, -1, 0) == MAP_FAILED) ||
+      (mmap(base + pg, sz, prot, MAP_SHARED|MAP_FIXED, fd, 0) == MAP_FAILED) ||
+      (mmap(base + pg + sz, sz, prot, MAP_SHARED|MAP_FIXED, fd, 0) == MAP_FAILED)) {
+    fprintf(stderr,"mmap: %s\n", strerror(errno));
+    goto done;
+  }
+
+  r = (ringbuf*)(base + pg - offsetof(ringbuf, d));
   r->u = r->i = r->o = 0;
   r->n = sz;
+  r->m = 1;
 
  done:
+  if (fd != -1) close(fd);
+  if ((r == NULL) && (base != MAP_FAILED)) munmap(base, pg + 2*sz);
+#endif
   return r;
 }
 
 void ringbuf_free(ringbuf* r) {
-  free(r);
+  size_t pg;
+  if (r->m) {
+    pg = sysconf(_SC_PAGESIZE);
+    munmap(r->d - pg, pg + 2*r->n);
+  } else free(r);
 }
 
 /* ringbuf_take: alternative to ringbuf_new; caller 
@@ -28,7 +88,7 @@ ringbuf *ringbuf_take(void *buf, size_t sz) {
   if (sz < MIN_RINGBUF) return NULL;
   ringbuf *r = (ringbuf*)buf;
 
-  r->u = r->i = r->o = 0;
+  r->u = r->i = r->o = r->m = 0;
   r->n = sz - sizeof(*r); // alignment should be ok
   assert(r->n > 0);
 
@@ -41,7 +101,10 @@ ringbuf *ringbuf_take(void *buf, size_t sz) {
 int ringbuf_put(ringbuf *r, const void *_data, size_t len) {
   char *data = (char*)_data;
   size_t a,b,c;
-  if (r->i < r->o) {  // available space is a contiguous buffer
+  if (r->m) {         // mirrored; the available space is contiguous
+    if (len > r->n - r->u) return -1;
+    memcpy(&r->d[r->i], data, len);
+  } else if (r->i < r->o) {  // available space is a contiguous buffer
     a = r->o - r->i; 
     assert(a == r->n - r->u);
     if (len > a) return -1;
@@ -71,6 +134,11 @@ size_t ringbuf_get_pending_size(ringbuf *r) {
 }
 
 size_t ringbuf_get_next_chunk(ringbuf *r, char **data) {
+  // mirrored, the whole pending buffer is contiguous
+  if (r->m) {
+    *data = r->u ? &r->d[r->o] : NULL;
+    return r->u;
+  }
   // in this case the next chunk is the whole pending buffer
   if (r->o < r->i) {
     assert(r->u == r->i - r->o);
@@ -92,6 +160,32 @@ size_t ringbuf_get_next_chunk(ringbuf *r, char **data) {
   return b;
 }
 
+/* like ringbuf_get_next_chunk, but starting off bytes into the pending
+ * output, for readers that each keep their own place in it */
+size_t ringbuf_get_chunk_at(ringbuf *r, size_t off, char **data) {
+  size_t p;
+  assert(off <= r->u);
+  if (off == r->u) { *data=NULL; return 0; }
+  p = (r->o + off) % r->n;
+  *data = &r->d[p];
+  return r->m ? r->u - off : MIN(r->u - off, r->n - p);
+}
+
+/* space for len bytes at the input pos, to fill in place then commit;
+ * NULL if there's not that much free, or (unmirrored) it would wrap */
+char *ringbuf_reserve(ringbuf *r, size_t len) {
+  if (len > r->n - r->u) return NULL;
+  if (!r->m && (len > r->n - r->i)) return NULL;
+  return &r->d[r->i];
+}
+
+/* add len bytes, written in place, to the pending output */
+void ringbuf_commit(ringbuf *r, size_t len) {
+  assert(len <= r->n - r->u);
+  r->i = (r->i + len) % r->n;
+  r->u += len;
+}
+
 void ringbuf_mark_consumed(ringbuf *r, size_t len) {
   assert(len <= r->u);
   r->o = (r->o + len ) % r->n;
@@ -12,17 +12,22 @@ typedef struct _ringbuf {
     size_t u; /* used space */
     size_t i; /* input pos */
     size_t o; /* output pos */
+    size_t m; /* mirrored: d[n..2n) maps onto d[0..n) */
     char d[]; /* C99 flexible array member */
 } ringbuf;
 
 ringbuf *ringbuf_new(size_t sz);
 ringbuf *ringbuf_take(void *buf, size_t sz);
+ringbuf *ringbuf_new_mirror(size_t sz);
 int ringbuf_put(ringbuf *r, const void *data, size_t len);
 size_t ringbuf_get_pending_size(ringbuf *r);
 size_t ringbuf_get_next_chunk(ringbuf *r, char **data);
+size_t ringbuf_get_chunk_at(ringbuf *r, size_t off, char **data);
 void ringbuf_mark_consumed(ringbuf *r, size_t len);
 void ringbuf_free(ringbuf *r);
 void ringbuf_clear(ringbuf *r);
 size_t ringbuf_get_freespace(ringbuf *r);
+char *ringbuf_reserve(ringbuf *r, size_t len);
+void ringbuf_commit(ringbuf *r, size_t len);
 
 #endif /* _RINGBUF_H_ */